@@ -0,0 +1,825 @@
+/* Copyright (C) 2002 Matthias S. Benkmann <matthias@winterdrache.de>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; version 2
+of the License (ONLY THIS VERSION).
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+/*
+Benchmarks of the conversion pipeline (see "make bench"). The images are
+generated deterministically, so that every run converts exactly the same
+pixels. Every benchmark reports a checksum of its output next to its time,
+so that an optimization that changes the result does not go unnoticed.
+
+  png2ico-bench [--filter <text>]        runs the benchmarks whose name contains
+                                         text and prints the results as JSON
+  png2ico-bench --compare old new        compares 2 result files and fails if
+                                         any checksum differs
+
+Most of the functions measured here are internal to the library and declared
+in libpng2ico_internal.h.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <png.h>
+
+#include "libpng2ico.h"
+#include "libpng2ico_internal.h"
+
+#include "VERSION"
+
+using namespace std;
+using namespace png2ico_internal;
+
+const double min_round_time=0.02; //each benchmark is run in rounds of at least this many seconds
+const int num_rounds=5;
+
+//deterministic pseudo random numbers (a linear congruential generator)
+class Random
+{
+  public:
+    Random(unsigned int seed):state(seed){};
+
+    //returns a number in [0,n)
+    unsigned int next(unsigned int n)
+    {
+      state=state*1664525u+1013904223u;
+      return (state>>8)%n;
+    };
+
+  private:
+    unsigned int state;
+};
+
+//an image of the corpus
+struct corpus_image
+{
+  string name;
+  int colorType; //the PNG color type it is stored with
+  rgba_image pixels;
+  vector<png_byte> png;
+};
+
+inline void setPixel(rgba_image& image, png_uint_32 x, png_uint_32 y, int r, int g, int b, int a)
+{
+  png_bytep pixel=&image.pixels[((size_t)y*image.width+x)*4];
+  pixel[0]=r;
+  pixel[1]=g;
+  pixel[2]=b;
+  pixel[3]=a;
+};
+
+//A few shapes of solid colors on a transparent background, like a typical
+//hand-drawn icon.
+void generateFlat(rgba_image& image, Random& random)
+{
+  int size=image.width;
+  int colors[6][3];
+  for (int c=0; c<6; ++c)
+    for (int i=0; i<3; ++i) colors[c][i]=random.next(256);
+
+  for (int y=0; y<size; ++y)
+    for (int x=0; x<size; ++x)
+    {
+      int dx=2*x-size;
+      int dy=2*y-size;
+      const int* color=NULL;
+      if (dx*dx+dy*dy<size*size*3/4) color=colors[0];
+      if (dx*dx+dy*dy<size*size/4) color=colors[1];
+      if (x>size/8 && x<size/3 && y>size/2) color=colors[2+(y*4/size)%4];
+      if (color==NULL)
+        setPixel(image,x,y,0,0,0,0);
+      else
+        setPixel(image,x,y,color[0],color[1],color[2],255);
+    };
+};
+
+//a smooth gradient with a different direction for each channel
+void generateGradient(rgba_image& image, Random&)
+{
+  int size=image.width;
+  for (int y=0; y<size; ++y)
+    for (int x=0; x<size; ++x)
+      setPixel(image,x,y,x*255/(size-1),y*255/(size-1),(size-1-x+y)*255/(2*size-2),255);
+};
+
+//Smooth value noise with some grain, similar to a photo: random values on a
+//coarse grid are interpolated bilinearly, and small random deviations are added.
+void generatePhoto(rgba_image& image, Random& random)
+{
+  int size=image.width;
+  const int grid=5;
+  int values[grid][grid][3];
+  for (int gy=0; gy<grid; ++gy)
+    for (int gx=0; gx<grid; ++gx)
+      for (int c=0; c<3; ++c) values[gy][gx][c]=random.next(256);
+
+  for (int y=0; y<size; ++y)
+    for (int x=0; x<size; ++x)
+    {
+      double fx=(double)x*(grid-1)/size;
+      double fy=(double)y*(grid-1)/size;
+      int gx=(int)fx;
+      int gy=(int)fy;
+      fx-=gx;
+      fy-=gy;
+      int color[3];
+      for (int c=0; c<3; ++c)
+      {
+        double top=values[gy][gx][c]*(1-fx)+values[gy][gx+1][c]*fx;
+        double bottom=values[gy+1][gx][c]*(1-fx)+values[gy+1][gx+1][c]*fx;
+        color[c]=min(max((int)(top*(1-fy)+bottom*fy)+(int)random.next(9)-4,0),255);
+      };
+      setPixel(image,x,y,color[0],color[1],color[2],255);
+    };
+};
+
+//A disc with soft edges and a shadow on a transparent background, so that many
+//pixels are partially transparent.
+void generateAlpha(rgba_image& image, Random& random)
+{
+  int size=image.width;
+  int r=random.next(256);
+  int g=random.next(256);
+  int b=random.next(256);
+  for (int y=0; y<size; ++y)
+    for (int x=0; x<size; ++x)
+    {
+      double dx=(x+0.5)/size-0.45;
+      double dy=(y+0.5)/size-0.45;
+      double dist=sqrt(dx*dx+dy*dy);
+      double sx=dx-0.06;
+      double sy=dy-0.06;
+      double shadow=max(0.0,1-sqrt(sx*sx+sy*sy)/0.45);
+      if (dist<0.38)
+      {
+        double shade=1-dist;
+        setPixel(image,x,y,(int)(r*shade),(int)(g*shade),(int)(b*shade),255);
+      }
+      else if (dist<0.42)
+        setPixel(image,x,y,r,g,b,(int)(255*(0.42-dist)/0.04));
+      else
+        setPixel(image,x,y,0,0,0,(int)(160*shadow));
+    };
+};
+
+//uniformly distributed random colors, i.e. as many colors as possible
+void generateNoise(rgba_image& image, Random& random)
+{
+  for (png_uint_32 y=0; y<image.height; ++y)
+    for (png_uint_32 x=0; x<image.width; ++x)
+      setPixel(image,x,y,random.next(256),random.next(256),random.next(256),255);
+};
+
+//blocks of 200 different colors, which fit into the palette of a PNG file
+void generateIndexed(rgba_image& image, Random& random)
+{
+  int colors[200][3];
+  for (int c=0; c<200; ++c)
+    for (int i=0; i<3; ++i) colors[c][i]=random.next(256);
+
+  for (png_uint_32 y=0; y<image.height; ++y)
+    for (png_uint_32 x=0; x<image.width; ++x)
+    {
+      const int* color=colors[(x/4+y/4*37)%200];
+      setPixel(image,x,y,color[0],color[1],color[2],255);
+    };
+};
+
+//Writes the rows of the PNG file described by the arguments into out. Returns
+//false and sets error if libpng fails.
+//NOTE: This function must not create any C++ objects because the setjmp()/longjmp()
+//error handling would skip their destructors.
+bool writeCorpusPNG(png_uint_32 width, png_uint_32 height, int colorType, png_bytep* rows,
+                    png_colorp palette, int numPalette, png_bytep trans, int numTrans,
+                    vector<png_byte>& out, string& error)
+{
+  png_structp png_ptr=png_create_write_struct
+                        (PNG_LIBPNG_VER_STRING, &error, storePNGError, ignorePNGWarning);
+  if (!png_ptr)
+  {
+    error="png_create_write_struct error";
+    return false;
+  };
+
+  png_infop info_ptr=png_create_info_struct(png_ptr);
+  if (!info_ptr)
+  {
+    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    error="png_create_info_struct error";
+    return false;
+  };
+
+  if (setjmp(png_jmpbuf(png_ptr)))
+  {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return false;
+  };
+
+  png_set_write_fn(png_ptr, &out, writeToVector, NULL);
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8, colorType,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  if (colorType==PNG_COLOR_TYPE_PALETTE)
+  {
+    png_set_PLTE(png_ptr, info_ptr, palette, numPalette);
+    if (numTrans>0) png_set_tRNS(png_ptr, info_ptr, trans, numTrans, NULL);
+  };
+  png_write_info(png_ptr, info_ptr);
+  png_write_image(png_ptr, rows);
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  return true;
+};
+
+//Encodes image.pixels as PNG file with image.colorType into image.png. Images
+//stored with a palette must not have more than 256 different RGBA colors.
+bool encodeCorpusImage(corpus_image& image, string& error)
+{
+  const rgba_image& src=image.pixels;
+  int bytesPerPixel=(image.colorType==PNG_COLOR_TYPE_RGB_ALPHA ? 4 : image.colorType==PNG_COLOR_TYPE_RGB ? 3 : 1);
+  vector<png_byte> data((size_t)src.width*src.height*bytesPerPixel);
+  vector<unsigned int> quads; //the colors of the palette as red+(green<<8)+(blue<<16)+(alpha<<24)
+  for (size_t i=0; i<(size_t)src.width*src.height; ++i)
+  {
+    png_const_bytep pixel=&src.pixels[i*4];
+    if (bytesPerPixel>1)
+    {
+      memcpy(&data[i*bytesPerPixel],pixel,bytesPerPixel);
+      continue;
+    };
+
+    unsigned int quad=pixel[0]+(pixel[1]<<8)+(pixel[2]<<16)+((unsigned int)pixel[3]<<24);
+    unsigned int index=find(quads.begin(),quads.end(),quad)-quads.begin();
+    if (index==quads.size())
+    {
+      if (quads.size()==256) {error=image.name+": too many colors for a palette"; return false;};
+      quads.push_back(quad);
+    };
+    data[i]=index;
+  };
+
+  png_color palette[256];
+  png_byte trans[256];
+  for (unsigned i=0; i<quads.size(); ++i)
+  {
+    palette[i].red=quads[i]&255;
+    palette[i].green=(quads[i]>>8)&255;
+    palette[i].blue=(quads[i]>>16)&255;
+    trans[i]=quads[i]>>24;
+  };
+  int numTrans=quads.size();
+  while(numTrans>0 && trans[numTrans-1]==255) --numTrans;
+
+  vector<png_bytep> rows(src.height);
+  for (png_uint_32 y=0; y<src.height; ++y) rows[y]=&data[(size_t)y*src.width*bytesPerPixel];
+  return writeCorpusPNG(src.width,src.height,image.colorType,&rows[0],palette,quads.size(),trans,numTrans,
+                        image.png,error);
+};
+
+//Generates the corpus into images. Returns false and sets error if an image can not be encoded.
+bool generateCorpus(vector<corpus_image>& images, string& error)
+{
+  struct corpus_entry
+  {
+    const char* name;
+    void (*generate)(rgba_image&, Random&);
+    int size;
+    int colorType;
+  };
+  const corpus_entry entries[]=
+  {
+    {"flat16",generateFlat,16,PNG_COLOR_TYPE_PALETTE},
+    {"flat32",generateFlat,32,PNG_COLOR_TYPE_RGB_ALPHA},
+    {"flat256",generateFlat,256,PNG_COLOR_TYPE_RGB_ALPHA},
+    {"gradient32",generateGradient,32,PNG_COLOR_TYPE_RGB},
+    {"gradient256",generateGradient,256,PNG_COLOR_TYPE_RGB},
+    {"photo48",generatePhoto,48,PNG_COLOR_TYPE_RGB},
+    {"photo128",generatePhoto,128,PNG_COLOR_TYPE_RGB},
+    {"photo256",generatePhoto,256,PNG_COLOR_TYPE_RGB},
+    {"alpha64",generateAlpha,64,PNG_COLOR_TYPE_RGB_ALPHA},
+    {"alpha256",generateAlpha,256,PNG_COLOR_TYPE_RGB_ALPHA},
+    {"noise64",generateNoise,64,PNG_COLOR_TYPE_RGB},
+    {"noise256",generateNoise,256,PNG_COLOR_TYPE_RGB},
+    {"indexed128",generateIndexed,128,PNG_COLOR_TYPE_PALETTE}
+  };
+
+  for (unsigned n=0; n<sizeof(entries)/sizeof(entries[0]); ++n)
+  {
+    images.push_back(corpus_image());
+    corpus_image& image=images.back();
+    image.name=entries[n].name;
+    image.colorType=entries[n].colorType;
+    image.pixels.width=image.pixels.height=entries[n].size;
+    image.pixels.pixels.resize((size_t)entries[n].size*entries[n].size*4);
+    Random random(n+1);
+    entries[n].generate(image.pixels,random);
+    if (!encodeCorpusImage(image,error)) return false;
+  };
+  return true;
+};
+
+//returns the hash of data as hexadecimal string
+string checksum(const hash128& hash)
+{
+  char buf[40];
+  snprintf(buf,sizeof(buf),"%016llx%016llx",hash.lo,hash.hi);
+  return buf;
+};
+
+//A benchmark. run() performs the measured operation once. It must produce the
+//same output every time, whose checksum is added to a hash by addChecksum().
+class Benchmark
+{
+  public:
+    virtual ~Benchmark(){};
+    virtual void run()=0;
+    virtual void addChecksum(hash128& hash) const=0;
+};
+
+//the result of measuring a Benchmark
+struct bench_result
+{
+  string name;
+  long iterations;     //number of runs per round
+  double nsPerOp;      //time of a run in the fastest round
+  double nsPerOpMedian;//time of a run in the median round
+  string checksum;
+};
+
+double secondsSince(const chrono::steady_clock::time_point& start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+};
+
+//Measures bench in num_rounds rounds that take at least min_round_time each.
+//Returns false if the output of the last run differs from that of the first.
+bool measure(const string& name, Benchmark& bench, bench_result& result)
+{
+  bench.run();
+  hash128 first;
+  bench.addChecksum(first);
+
+  long iterations=1;
+  for(;;)
+  {
+    chrono::steady_clock::time_point start=chrono::steady_clock::now();
+    for (long i=0; i<iterations; ++i) bench.run();
+    if (secondsSince(start)>=min_round_time) break;
+    iterations*=2;
+  };
+
+  vector<double> times;
+  for (int round=0; round<num_rounds; ++round)
+  {
+    chrono::steady_clock::time_point start=chrono::steady_clock::now();
+    for (long i=0; i<iterations; ++i) bench.run();
+    times.push_back(secondsSince(start)*1e9/iterations);
+  };
+  sort(times.begin(),times.end());
+
+  hash128 last;
+  bench.addChecksum(last);
+  result.name=name;
+  result.iterations=iterations;
+  result.nsPerOp=times[0];
+  result.nsPerOpMedian=times[num_rounds/2];
+  result.checksum=checksum(first);
+  return (first.lo==last.lo && first.hi==last.hi);
+};
+
+//Sets up job for image with the given number of colors and quantizer, decodes it
+//and gathers its colors, but does not convert them to indexed colors.
+void loadCorpusImage(const corpus_image& image, int colors, const char* quantizer, png2ico_image& source, image_job& job)
+{
+  source.name=image.name.c_str();
+  source.png=&image.png[0];
+  source.png_size=image.png.size();
+  source.colors=colors;
+  source.quantizer=quantizer;
+  if (setupImageJob(job,source)) loadColors(job);
+};
+
+//convertToIndexed() of the colors of an image, including copying them
+class ConvertBenchmark: public Benchmark
+{
+  public:
+    ConvertBenchmark(const png_data& img):base(img){};
+
+    virtual void run()
+    {
+      work.colors=base.colors;
+      work.indexed=base.indexed;
+      memcpy(work.indexQuad,base.indexQuad,sizeof(work.indexQuad));
+      work.source=base.source;
+      work.requested_colors=base.requested_colors;
+      work.refine_iterations=base.refine_iterations;
+      work.quantizer=base.quantizer;
+      work.tooManyColors=convertToIndexed(work);
+    };
+
+    virtual void addChecksum(hash128& hash) const
+    {
+      hash.add(&work.num_palette,sizeof(work.num_palette));
+      hash.add(work.palette,work.num_palette*sizeof(png_color));
+      hash.add(&work.colors.palEntry[0],work.colors.palEntry.size()*sizeof(int));
+      hash.add(&work.tooManyColors,sizeof(work.tooManyColors));
+    };
+
+  private:
+    const png_data& base;
+    png_data work;
+};
+
+//a row kernel applied to all rows of a 256x256 image
+class RowKernelBenchmark: public Benchmark
+{
+  public:
+    //nbits is the number of bits per pixel for a pack() kernel, 0 for an alphaMask() kernel
+    RowKernelBenchmark(int (*p)(png_const_bytep,int,int,png_bytep), int (*a)(png_const_bytep,int,png_bytep), int n)
+      :pack(p),alphaMask(a),nbits(n),input(256*256*4),output(256*256)
+    {
+      Random random(12345);
+      for (unsigned i=0; i<input.size(); ++i) input[i]=random.next(256)&(nbits>0 ? (1<<nbits)-1 : 255);
+    };
+
+    virtual void run()
+    {
+      for (int y=0; y<256; ++y)
+      {
+        if (pack!=NULL)
+          pack(&input[y*256],256,nbits,&output[y*256]);
+        else
+          alphaMask(&input[y*256*4],256,&output[y*256]);
+      };
+    };
+
+    virtual void addChecksum(hash128& hash) const
+    {
+      hash.add(&output[0],output.size());
+    };
+
+  private:
+    int (*pack)(png_const_bytep,int,int,png_bytep);
+    int (*alphaMask)(png_const_bytep,int,png_bytep);
+    int nbits;
+    vector<png_byte> input;
+    vector<png_byte> output;
+};
+
+//storing the XOR and AND masks of a converted image, including decoding it again
+class MaskBenchmark: public Benchmark
+{
+  public:
+    MaskBenchmark(const png_data& i):img(i),masks((size_t)(xorMaskLineLen(i)+andMaskLineLen(i))*i.height)
+    {
+      job.img=&img;
+      job.resource=&masks[0];
+      job.xorMask=&masks[0];
+      job.andMask=&masks[(size_t)xorMaskLineLen(img)*img.height];
+      job.numThreads=1;
+    };
+
+    virtual void run()
+    {
+      storeImageResource(job);
+    };
+
+    virtual void addChecksum(hash128& hash) const
+    {
+      hash.add(&job.status,sizeof(job.status));
+      hash.add(&masks[0],masks.size());
+    };
+
+  private:
+    const png_data& img;
+    vector<png_byte> masks;
+    mask_job job;
+};
+
+//serializeIcon() of converted images
+class WriterBenchmark: public Benchmark
+{
+  public:
+    WriterBenchmark(const vector<png_data>& p):pngdata(p),ico(iconSize(p)){};
+
+    virtual void run()
+    {
+      string error;
+      serializeIcon(pngdata,&ico[0],1,error);
+    };
+
+    virtual void addChecksum(hash128& hash) const
+    {
+      hash.add(&ico[0],ico.size());
+    };
+
+  private:
+    const vector<png_data>& pngdata;
+    vector<png_byte> ico;
+};
+
+//png2ico_convert() from the PNG files to the finished icon
+class ConvertIconBenchmark: public Benchmark
+{
+  public:
+    ConvertIconBenchmark(const vector<png2ico_image>& i):images(i){};
+
+    virtual void run()
+    {
+      png2ico_convert(&images[0],images.size(),1,ico,NULL);
+    };
+
+    virtual void addChecksum(hash128& hash) const
+    {
+      if (!ico.empty()) hash.add(&ico[0],ico.size());
+    };
+
+  private:
+    const vector<png2ico_image>& images;
+    vector<unsigned char> ico;
+};
+
+//the benchmarks of a run and where their results go
+struct bench_run
+{
+  const char* filter; //only benchmarks whose name contains this are run
+  vector<bench_result> results;
+  bool ok;            //false if a benchmark did not give the same output every time
+  bench_run(const char* f):filter(f),ok(true){};
+
+  void add(const string& name, Benchmark& bench)
+  {
+    if (name.find(filter)==string::npos) return;
+    bench_result result;
+    if (!measure(name,bench,result))
+    {
+      fprintf(stderr,"%s: output differs between runs\n",name.c_str());
+      ok=false;
+    };
+    fprintf(stderr,"%-40s %12.0f ns\n",name.c_str(),result.nsPerOp);
+    results.push_back(result);
+  };
+};
+
+//returns the corpus images used for the icon "set", each as png2ico_image
+vector<png2ico_image> iconImages(const vector<corpus_image>& corpus, const char* set)
+{
+  vector<png2ico_image> images;
+  for (unsigned n=0; n<corpus.size(); ++n)
+  {
+    png2ico_image image;
+    image.name=corpus[n].name.c_str();
+    image.png=&corpus[n].png[0];
+    image.png_size=corpus[n].png.size();
+    if (strcmp(set,"favicon")==0)
+    {
+      if (corpus[n].name=="flat16" || corpus[n].name=="flat32") images.push_back(image);
+    }
+    else if (strcmp(set,"sizes")==0) //an application icon scaled from a large image
+    {
+      if (corpus[n].name!="photo256") continue;
+      const int sizes[]={16,24,32,48,64,256};
+      for (unsigned s=0; s<sizeof(sizes)/sizeof(sizes[0]); ++s)
+      {
+        image.size=sizes[s];
+        image.format=(sizes[s]==256 ? PNG2ICO_PNG : PNG2ICO_PALETTE);
+        images.push_back(image);
+      };
+    }
+    else if (strcmp(set,"formats")==0)
+    {
+      if (corpus[n].name=="alpha64")
+      {
+        images.push_back(image);
+        image.format=PNG2ICO_BGRA;
+        images.push_back(image);
+      };
+      if (corpus[n].name=="alpha256")
+      {
+        image.format=PNG2ICO_PNG;
+        images.push_back(image);
+      };
+    };
+  };
+  return images;
+};
+
+//Runs all benchmarks of the corpus. Returns false if one of them failed.
+bool runBenchmarks(const vector<corpus_image>& corpus, bench_run& run)
+{
+  const int colorCounts[]={2,16,256};
+  const char* const quantizers[]={"farthest","mediancut","wu"};
+
+  for (unsigned n=0; n<corpus.size(); ++n)
+  {
+    for (unsigned c=0; c<sizeof(colorCounts)/sizeof(colorCounts[0]); ++c)
+    {
+      for (unsigned q=0; q<sizeof(quantizers)/sizeof(quantizers[0]); ++q)
+      {
+        if (q>0 && colorCounts[c]!=256) continue; //the other quantizers only at 256 colors
+
+        png2ico_image source;
+        image_job job;
+        loadCorpusImage(corpus[n],colorCounts[c],quantizers[q],source,job);
+        if (job.status!=PNG2ICO_OK)
+        {
+          fputs(job.error.c_str(),stderr);
+          return false;
+        };
+
+        char name[128];
+        snprintf(name,sizeof(name),"convertToIndexed/%s/%s/%d",corpus[n].name.c_str(),quantizers[q],colorCounts[c]);
+        ConvertBenchmark convert(job.data);
+        run.add(name,convert);
+        if (q>0) continue;
+
+        //the masks of the image with the palette of the default quantizer
+        job.data.tooManyColors=convertToIndexed(job.data);
+        snprintf(name,sizeof(name),"masks/%s/%d",corpus[n].name.c_str(),colorCounts[c]);
+        MaskBenchmark masks(job.data);
+        run.add(name,masks);
+      };
+    };
+  };
+
+  struct row_kernel
+  {
+    const char* name;
+    int (*pack)(png_const_bytep,int,int,png_bytep);
+    int (*alphaMask)(png_const_bytep,int,png_bytep);
+  };
+  vector<row_kernel> kernels;
+  row_kernel scalar={"scalar",pack,alphaMask};
+  kernels.push_back(scalar);
+#ifdef PNG2ICO_X86_KERNELS
+  __builtin_cpu_init();
+  row_kernel sse2={"sse2",packSSE2,alphaMaskSSE2};
+  row_kernel avx2={"avx2",packAVX2,alphaMaskAVX2};
+  if (__builtin_cpu_supports("sse2")) kernels.push_back(sse2);
+  if (__builtin_cpu_supports("avx2")) kernels.push_back(avx2);
+#endif
+  for (unsigned k=0; k<kernels.size(); ++k)
+  {
+    const int bits[]={1,4,8};
+    for (unsigned b=0; b<sizeof(bits)/sizeof(bits[0]); ++b)
+    {
+      RowKernelBenchmark bench(kernels[k].pack,NULL,bits[b]);
+      run.add(string("pack/")+kernels[k].name+"/"+(bits[b]==1 ? "1" : bits[b]==4 ? "4" : "8"),bench);
+    };
+    RowKernelBenchmark bench(NULL,kernels[k].alphaMask,0);
+    run.add(string("alphaMask/")+kernels[k].name,bench);
+  };
+
+  const char* const sets[]={"favicon","sizes","formats"};
+  for (unsigned s=0; s<sizeof(sets)/sizeof(sets[0]); ++s)
+  {
+    vector<png2ico_image> images=iconImages(corpus,sets[s]);
+    vector<image_job> jobs;
+    vector<png_data> pngdata;
+    string messages;
+    if (convertImages(&images[0],images.size(),1,jobs,pngdata,&messages)!=PNG2ICO_OK)
+    {
+      fputs(messages.c_str(),stderr);
+      return false;
+    };
+
+    WriterBenchmark writer(pngdata);
+    run.add(string("serializeIcon/")+sets[s],writer);
+    ConvertIconBenchmark convert(images);
+    run.add(string("png2ico_convert/")+sets[s],convert);
+  };
+  return true;
+};
+
+//prints the results of run and the description of corpus as JSON object. Every
+//benchmark is on a line of its own, which compareResults() relies on.
+void printResults(const vector<corpus_image>& corpus, const bench_run& run)
+{
+  printf("{\n\"version\":\"%s\",\n\"corpus\":[\n",version);
+  for (unsigned n=0; n<corpus.size(); ++n)
+  {
+    png2ico_image source;
+    image_job job;
+    loadCorpusImage(corpus[n],256,"farthest",source,job);
+    hash128 hash;
+    hash.add(&corpus[n].png[0],corpus[n].png.size());
+    printf("{\"name\":\"%s\",\"width\":%u,\"height\":%u,\"color_type\":%d,\"unique_colors\":%u,\"png_size\":%lu,\"checksum\":\"%s\"}%s\n",
+           corpus[n].name.c_str(),corpus[n].pixels.width,corpus[n].pixels.height,corpus[n].colorType,
+           job.data.colors.size(),(unsigned long)corpus[n].png.size(),checksum(hash).c_str(),
+           n+1<corpus.size() ? "," : "");
+  };
+  printf("],\n\"benchmarks\":[\n");
+  for (unsigned n=0; n<run.results.size(); ++n)
+  {
+    const bench_result& result=run.results[n];
+    printf("{\"name\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.1f,\"ns_per_op_median\":%.1f,\"checksum\":\"%s\"}%s\n",
+           result.name.c_str(),result.iterations,result.nsPerOp,result.nsPerOpMedian,result.checksum.c_str(),
+           n+1<run.results.size() ? "," : "");
+  };
+  printf("]\n}\n");
+};
+
+//Reads the benchmark lines of the results file fileName into results. Returns
+//false if the file can not be read.
+bool readResults(const char* fileName, vector<bench_result>& results)
+{
+  FILE* f=fopen(fileName,"r");
+  if (f==NULL) {perror(fileName); return false;};
+
+  char line[1024];
+  while(fgets(line,sizeof(line),f)!=NULL)
+  {
+    char name[256];
+    char sum[64];
+    bench_result result;
+    if (sscanf(line,"{\"name\":\"%255[^\"]\",\"iterations\":%ld,\"ns_per_op\":%lf,\"ns_per_op_median\":%lf,\"checksum\":\"%63[^\"]\"",
+               name,&result.iterations,&result.nsPerOp,&result.nsPerOpMedian,sum)!=5) continue;
+    result.name=name;
+    result.checksum=sum;
+    results.push_back(result);
+  };
+  fclose(f);
+  return true;
+};
+
+//Compares the results files oldName and newName and prints the speedup of every
+//benchmark they have in common. Returns the exit code for main(), which is 1 if
+//a checksum differs.
+int compareResults(const char* oldName, const char* newName)
+{
+  vector<bench_result> oldResults;
+  vector<bench_result> newResults;
+  if (!readResults(oldName,oldResults) || !readResults(newName,newResults)) return 1;
+
+  int numChanged=0;
+  for (unsigned n=0; n<newResults.size(); ++n)
+  {
+    const bench_result& now=newResults[n];
+    for (unsigned o=0; o<oldResults.size(); ++o)
+    {
+      const bench_result& before=oldResults[o];
+      if (before.name!=now.name) continue;
+      bool changed=(before.checksum!=now.checksum);
+      if (changed) ++numChanged;
+      printf("%-40s %12.0f ns %12.0f ns %7.2fx%s\n",now.name.c_str(),before.nsPerOp,now.nsPerOp,
+             now.nsPerOp>0 ? before.nsPerOp/now.nsPerOp : 0,changed ? "  OUTPUT CHANGED" : "");
+    };
+  };
+
+  if (numChanged>0)
+  {
+    fprintf(stderr,"%d benchmarks have a different output\n",numChanged);
+    return 1;
+  };
+  return 0;
+};
+
+void usage()
+{
+  fprintf(stderr,"USAGE: png2ico-bench [--filter <text>]\n");
+  fprintf(stderr,"       png2ico-bench --compare old.json new.json\n");
+  exit(1);
+};
+
+int main(int argc, char* argv[])
+{
+  if (argc==4 && strcmp(argv[1],"--compare")==0) return compareResults(argv[2],argv[3]);
+
+  const char* filter="";
+  if (argc==3 && strcmp(argv[1],"--filter")==0)
+    filter=argv[2];
+  else if (argc!=1)
+    usage();
+
+  vector<corpus_image> corpus;
+  string error;
+  if (!generateCorpus(corpus,error))
+  {
+    fprintf(stderr,"%s\n",error.c_str());
+    return 1;
+  };
+
+  bench_run run(filter);
+  if (!runBenchmarks(corpus,run)) return 1;
+  printResults(corpus,run);
+  return run.ok ? 0 : 1;
+};
@@ -0,0 +1,4220 @@
+/* Copyright (C) 2002 Matthias S. Benkmann <matthias@winterdrache.de>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; version 2
+of the License (ONLY THIS VERSION).
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+/*
+Notes about transparent and inverted pixels:
+ Handling of transparent pixels is inconsistent in Windows. Sometimes a
+ pixel with an AND mask value of 1 is just transparent (i.e. its color 
+ value is ignored), sometimes the color value is XORed with the background to
+ give some kind of inverted effect. A closer look at bmp.txt suggests that
+ the latter behaviour is the correct one but because it often doesn't happen
+ it's de facto undefined behaviour.
+ Furthermore, sometimes the AND mask entry seems to be interpreted as a
+ color index, i.e. a value of 1 will AND the background with color 1.
+ Conclusion: The most robust solution seems to be:
+               -color 0 always 0,0,0
+               -color 1 always 255,255,255
+               -all transparent pixels get color 0
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <csetjmp>
+#include <vector>
+#include <string>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cmath>
+#include <chrono>
+#include <ctime>
+
+#include <cerrno>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+#include <png.h>
+
+#include "libpng2ico.h"
+#include "libpng2ico_internal.h"
+
+#ifdef PNG2ICO_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace png2ico_internal {
+
+const int word_max=65535;
+const int transparency_threshold=196;
+const size_t mmap_write_threshold=65536; //icon files of at least this size are written through a memory mapping
+const int resample_bits=12; //number of fractional bits of the filter weights used by scaleImage()
+const int min_band_pixels=16384; //images in memory are split into bands of at least this many pixels that are processed in parallel
+const int palette_cache_bits=10; //PaletteMapper caches the palette entries of 2^palette_cache_bits colors
+const int cache_version=3; //part of the key of a png2ico_cache. Must be increased whenever the conversion gives a different result.
+const int cache_header_size=8; //"P2IC", width, height, bit depth and color reduction warning of a cached image
+const unsigned max_known_caches=16; //number of caches whose size evictCache() remembers
+const int cache_evict_percent=75; //a png2ico_cache that has grown beyond max_size is shrunk to this percentage of it
+const unsigned max_kept_images=16; //a thread keeps the buffers of at most this many images of its last conversion for the next one
+const int color_reduce_warning_threshold=512; //maximum quadratic euclidean distance in RGB color space that a palette color may have to a source color assigned to it before a warning is issued
+
+//The put functions store a value at out in little endian byte order and advance out.
+static inline void putWord(png_bytep& out, int word)
+{
+  *out++=(word&255);
+  *out++=(word>>8)&255;
+};
+
+static inline void putDWord(png_bytep& out, unsigned int dword)
+{
+  *out++=(dword&255);
+  *out++=(dword>>8)&255;
+  *out++=(dword>>16)&255;
+  *out++=(dword>>24)&255;
+};
+
+static inline void putByte(png_bytep& out, int byte)
+{
+  *out++=(byte&255);
+};
+
+//The get functions return the little endian value at in.
+static inline unsigned int getWord(png_const_bytep in)
+{
+  return in[0]+(in[1]<<8);
+};
+
+static inline unsigned int getDWord(png_const_bytep in)
+{
+  return in[0]+(in[1]<<8)+(in[2]<<16)+((unsigned int)in[3]<<24);
+};
+
+
+
+//returns the CPU time the calling thread has used, in seconds
+static double threadCPUTime()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts)!=0) return 0;
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+#endif
+};
+
+namespace {
+
+//Measures the wall clock and CPU time the calling thread spends between the
+//construction of the Stopwatch and stop() (or its destruction) and adds it to
+//*time. Does nothing if time is NULL, i.e. if no statistics were requested.
+class Stopwatch
+{
+  public:
+    Stopwatch(png2ico_time* t):time(t),cpuStart(0)
+    {
+      if (time==NULL) return;
+      wallStart=chrono::steady_clock::now();
+      cpuStart=threadCPUTime();
+    };
+    ~Stopwatch() {stop();};
+    
+    void stop()
+    {
+      if (time==NULL) return;
+      time->wall+=chrono::duration<double>(chrono::steady_clock::now()-wallStart).count();
+      time->cpu+=threadCPUTime()-cpuStart;
+      time=NULL;
+    };
+    
+  private:
+    png2ico_time* time;
+    chrono::steady_clock::time_point wallStart;
+    double cpuStart;
+};
+
+};
+
+//Adds the time of a pass over an image to phase, except for the time that was
+//spent decoding the PNG file during the pass, i.e. the difference between
+//decodeAfter and decodeBefore.
+static void addPassTime(png2ico_time& phase, const png2ico_time& pass, const png2ico_time& decodeBefore,
+                        const png2ico_time& decodeAfter)
+{
+  phase.wall+=max(0.0,pass.wall-(decodeAfter.wall-decodeBefore.wall));
+  phase.cpu+=max(0.0,pass.cpu-(decodeAfter.cpu-decodeBefore.cpu));
+};
+
+
+namespace {
+
+//a band of rows of an image whose colors are gathered by gatherColorsN()
+struct color_band
+{
+  const rgba_image* pixels;
+  png_uint_32 first, last; //the rows [first,last)
+  color_table colors;
+  bool outOfMemory;
+  bool timed;        //true if the time spent on the band is measured in time
+  png2ico_time time;
+};
+
+//a band of rows of an image whose masks are stored by writeImageMasksBandN()
+struct mask_band
+{
+  const mask_job* job;
+  png_uint_32 first, last; //the rows [first,last)
+  int status;
+  string error;
+  bool timed;        //true if the time spent on the band is measured in time
+  png2ico_time time;
+};
+
+//Working memory of the conversion that is kept by each thread and reused for
+//all images the thread converts, so that converting many images in a row (as in
+//batch and server mode) does not allocate and free the same buffers again and
+//again. The threads of parallelFor() last as long as the program for the same
+//reason. The buffers only grow, to what the largest image converted by the 
+//thread needed: a few rows of at most 256 pixels and the colors of the image.
+//Only what depends on the size of a PNG file rather than of an icon image is 
+//still allocated per image: the decoded pixels of master images and of
+//interlaced PNG files, and the pixels of the images scaled from them.
+//Each buffer may only be used by one function at a time.
+struct scratch_buffers
+{
+  vector<png_byte> rows;   //decoded rows (gatherColors(), writeImageMasks())
+  vector<png_byte> index;  //palette entries of a row (writeImageMasks())
+  vector<png_byte> trans;  //transparency of a row (writeImageMasks())
+  vector<unsigned long long> runs; //ColorCollector
+  color_table merged;              //ColorCollector::flush()
+  vector<unsigned int> candidates; //FarthestPointQuantizer, MedianCutQuantizer
+  vector<int> candMinDist, candDistSum;
+  vector<long long> wuWeight, wuRed, wuGreen, wuBlue; //wu_moments
+  vector<double> wuSquares;
+  vector<color_band> colorBands;   //gatherColorsInBands()
+  vector<mask_band> maskBands;     //writeImageMasksInBands()
+  
+  //The images of the last conversion run on this thread by png2ico_convert() and
+  //its variants. Up to max_kept_images of them keep their color tables and 
+  //resources for the images of the next conversion (see finishConversion()).
+  vector<image_job> jobs;
+  vector<png_data> pngdata;
+  vector<int> masterOf;       //convertImages()
+  vector<bool> paletteDone;   //convertSharedPalettes()
+  vector<mask_job> maskJobs;  //serializeIcon()
+};
+
+};
+
+//returns the scratch_buffers of the calling thread
+static scratch_buffers& threadScratch()
+{
+  static thread_local scratch_buffers scratch;
+  return scratch;
+};
+
+int andMaskLineLen(const png_data& img)
+{
+  int len=(img.width+7)>>3;
+  return (len+3)&~3;
+};
+
+int xorMaskLineLen(const png_data& img)
+{
+  return ((img.width*img.col_bits+31)>>5)<<2;
+};
+
+//returns true if pixel (RGBA if hasAlpha, RGB otherwise) is transparent. hasAlpha is
+//a template argument so that the pixel loops are compiled once for each case.
+template<bool hasAlpha> static inline bool checkTransparent(png_const_bytep pixel)
+{
+  return hasAlpha && pixel[3]<transparency_threshold;
+};
+
+namespace {
+
+//k-d tree over the entries of a palette that finds the entry closest to a given
+//color without comparing against every entry. The tree is stored implicitly in
+//a flat array: the node for the range [lo,hi) is at (lo+hi)/2, its left subtree
+//is [lo,mid) and its right subtree is [mid+1,hi).
+//Like a linear search over the palette, nearest() returns the entry with the
+//lowest index if several entries have the same distance.
+class PaletteTree
+{
+  public:
+    PaletteTree(png_colorp palette, int num_palette);
+    
+    //returns the index of the palette entry closest to (red,green,blue) and 
+    //stores its quadratic distance in *dist if dist!=NULL
+    int nearest(int red, int green, int blue, int* dist=NULL) const;
+    
+  private:
+    struct Node
+    {
+      int col[3];
+      int index; //index into the palette
+      int axis;  //component by which this node splits its subtrees
+    };
+    
+    Node nodes[256];
+    int numNodes;
+    
+    void build(int lo, int hi);
+    void search(int lo, int hi, const int* col, int& bestIndex, int& bestDist) const;
+    
+    struct AxisLess
+    {
+      int axis;
+      AxisLess(int a):axis(a){};
+      bool operator()(const Node& a, const Node& b) const {return a.col[axis]<b.col[axis];};
+    };
+};
+
+};
+
+PaletteTree::PaletteTree(png_colorp palette, int num_palette):numNodes(num_palette)
+{
+  for (int i=0; i<num_palette; ++i)
+  {
+    nodes[i].col[0]=palette[i].red;
+    nodes[i].col[1]=palette[i].green;
+    nodes[i].col[2]=palette[i].blue;
+    nodes[i].index=i;
+    nodes[i].axis=0;
+  };
+  build(0,num_palette);
+};
+
+void PaletteTree::build(int lo, int hi)
+{
+  if (hi-lo<=0) return;
+  
+  //split along the component with the largest spread
+  int minCol[3]={INT_MAX,INT_MAX,INT_MAX};
+  int maxCol[3]={INT_MIN,INT_MIN,INT_MIN};
+  for (int i=lo; i<hi; ++i)
+    for (int a=0; a<3; ++a)
+    {
+      if (nodes[i].col[a]<minCol[a]) minCol[a]=nodes[i].col[a];
+      if (nodes[i].col[a]>maxCol[a]) maxCol[a]=nodes[i].col[a];
+    };
+  
+  int axis=0;
+  for (int a=1; a<3; ++a)
+    if (maxCol[a]-minCol[a]>maxCol[axis]-minCol[axis]) axis=a;
+  
+  int mid=(lo+hi)/2;
+  nth_element(nodes+lo,nodes+mid,nodes+hi,AxisLess(axis));
+  nodes[mid].axis=axis;
+  build(lo,mid);
+  build(mid+1,hi);
+};
+
+void PaletteTree::search(int lo, int hi, const int* col, int& bestIndex, int& bestDist) const
+{
+  if (hi-lo<=0) return;
+  
+  int mid=(lo+hi)/2;
+  const Node& node=nodes[mid];
+  int dist=(col[0]-node.col[0]);
+  dist*=dist;
+  int temp=(col[1]-node.col[1]);
+  dist+=temp*temp;
+  temp=(col[2]-node.col[2]);
+  dist+=temp*temp;
+  if (dist<bestDist || (dist==bestDist && node.index<bestIndex)) 
+  {
+    bestDist=dist;
+    bestIndex=node.index;
+  };
+  
+  int planeDist=col[node.axis]-node.col[node.axis];
+  if (planeDist<0)
+  {
+    search(lo,mid,col,bestIndex,bestDist);
+    if (planeDist*planeDist<=bestDist) search(mid+1,hi,col,bestIndex,bestDist);
+  }
+  else
+  {
+    search(mid+1,hi,col,bestIndex,bestDist);
+    if (planeDist*planeDist<=bestDist) search(lo,mid,col,bestIndex,bestDist);
+  };
+};
+
+int PaletteTree::nearest(int red, int green, int blue, int* dist) const
+{
+  int col[3]={red,green,blue};
+  int bestIndex=INT_MAX;
+  int bestDist=INT_MAX;
+  search(0,numNodes,col,bestIndex,bestDist);
+  if (dist!=NULL) *dist=bestDist;
+  return bestIndex;
+};
+
+//Adjusts all palette entries of img (except for 0 and 1) to be the mean of all
+//colors mapped to them.
+static void adjustPaletteToMeans(png_data& img, const color_table& colors)
+{
+  unsigned int red[256];
+  unsigned int green[256];
+  unsigned int blue[256];
+  unsigned int numMappings[256];
+  memset(red,0,sizeof(red));
+  memset(green,0,sizeof(green));
+  memset(blue,0,sizeof(blue));
+  memset(numMappings,0,sizeof(numMappings));
+  
+  for (unsigned c=0; c<colors.size(); ++c)
+  {
+    int i=colors.palEntry[c];
+    unsigned int quad=colors.quad[c];
+    red[i]+=quad&255;
+    green[i]+=(quad>>8)&255;
+    blue[i]+=(quad>>16)&255;
+    ++numMappings[i];
+  };
+  
+  for (int i=2; i<img.num_palette; ++i)
+  {
+    unsigned int n=numMappings[i];
+    if (n>0)
+    {
+      img.palette[i].red=(red[i]+n/2)/n;
+      img.palette[i].green=(green[i]+n/2)/n;
+      img.palette[i].blue=(blue[i]+n/2)/n;
+    };
+  };
+};
+
+//A Quantizer chooses the palette for an image. 
+//When choosePalette() is called, img.palette contains img.num_palette fixed entries
+//and every color in colors that is mapped to one of them has its palEntry set. 
+//choosePalette() adds entries until there are at most img.requested_colors. It may
+//map colors to the entries it adds. All colors it leaves unmapped will afterwards 
+//be mapped to the closest palette entry.
+class Quantizer
+{
+  public:
+    virtual ~Quantizer(){};
+    virtual void choosePalette(png_data& img, color_table& colors) const=0;
+};
+
+namespace {
+
+//Fills up the palette with colors from the image by repeatedly picking the
+//color most different from the previously picked colors and adding this to the
+//palette. This is done to make sure that in case there are more image colors than
+//palette entries, palette entries are not wasted on similar colors.
+class FarthestPointQuantizer: public Quantizer
+{
+  public:
+    virtual void choosePalette(png_data& img, color_table& colors) const;
+};
+
+//Heckbert's median cut: starts with one box containing all unmapped colors and
+//repeatedly splits the box with the largest error at the pixel-weighted median of
+//its longest side. Each box contributes the weighted mean of its colors.
+class MedianCutQuantizer: public Quantizer
+{
+  public:
+    virtual void choosePalette(png_data& img, color_table& colors) const;
+};
+
+//Xiaolin Wu's quantizer (Graphics Gems II): builds cumulative color moments over a
+//33x33x33 histogram and recursively cuts the box with the largest variance where
+//the cut minimizes the summed variance of the two halves. 
+class WuQuantizer: public Quantizer
+{
+  public:
+    virtual void choosePalette(png_data& img, color_table& colors) const;
+};
+
+};
+
+const FarthestPointQuantizer farthestPointQuantizer;
+const MedianCutQuantizer medianCutQuantizer;
+const WuQuantizer wuQuantizer;
+
+//Returns the number of buckets of the hash_map png2ico 2003-01-14 kept the colors
+//in, after it had been asked to hold numElements of them (it grows to the next
+//size in this list whenever an access finds it full).
+static unsigned long colorMapBuckets(unsigned long numElements)
+{
+  static const unsigned long sizes[]={193ul, 389ul, 769ul, 1543ul, 3079ul, 6151ul,
+    12289ul, 24593ul, 49157ul, 98317ul, 196613ul, 393241ul, 786433ul, 1572869ul,
+    3145739ul, 6291469ul, 12582917ul, 25165843ul, 50331653ul, 100663319ul, 
+    201326611ul, 402653189ul, 805306457ul, 1610612741ul, 3221225473ul, 4294967291ul};
+  const unsigned long* end=sizes+sizeof(sizes)/sizeof(sizes[0]);
+  const unsigned long* size=lower_bound(sizes,end,numElements);
+  return size==end ? end[-1] : *size;
+};
+
+//For every unmapped color the smallest distance and the sum of distances to the
+//palette entries are kept up to date incrementally, so that each round only has to
+//compare against the entry added in the previous round.
+//Of several colors that are equally far from the palette, png2ico 2003-01-14 picked
+//the first one in the bucket order of its hash_map, i.e. the one with the smallest
+//quad modulo the number of buckets. Ties are broken the same way, so that icons do
+//not change. Only colors in the same bucket are ordered by quad instead of by the
+//order in which their pixels were read, which png2ico no longer keeps track of.
+void FarthestPointQuantizer::choosePalette(png_data& img, color_table& colors) const
+{
+  scratch_buffers& scratch=threadScratch();
+  scratch.candidates.clear();
+  for (unsigned c=0; c<colors.size(); ++c)
+  {
+    if (colors.palEntry[c]<0) scratch.candidates.push_back(c);
+  };
+  scratch.candMinDist.assign(scratch.candidates.size(),INT_MAX);
+  scratch.candDistSum.assign(scratch.candidates.size(),0);
+  
+  //plain pointers into the scratch buffers, which the compiler can keep in registers
+  const unsigned int* candidates=scratch.candidates.data(); //indexes into colors
+  int* candMinDist=scratch.candMinDist.data();
+  int* candDistSum=scratch.candDistSum.data();
+  unsigned numCandidates=scratch.candidates.size();
+  int firstNewEntry=0; //palette entries from this index on have not yet been accounted for
+  
+  //The hash_map was last accessed to add white, which was only new to it if no
+  //pixel is white (see convertToIndexed()), and is accessed again for every color
+  //added to the palette.
+  unsigned long numElements=colors.size();
+  bool whitePresent=(colors.count[colors.find(255u+(255u<<8)+(255u<<16)+(255u<<24))]>0);
+  unsigned long buckets=colorMapBuckets(whitePresent ? numElements+1 : numElements);
+  
+  while(img.num_palette<img.requested_colors)
+  {
+    int mostDifferent=-1;
+    int mdqMinDist=-1; //smallest distance to an entry in the palette for mostDifferent
+    int mdqDistSum=-1; //sum over all distances to palette entries for mostDifferent
+    for (unsigned c=0; c<numCandidates; ++c)
+    {
+      if (colors.palEntry[candidates[c]]>=0) continue; //already picked as palette entry
+      
+      unsigned int quad=colors.quad[candidates[c]];
+      int red=quad&255;  //must be signed
+      int green=(quad>>8)&255;
+      int blue=(quad>>16)&255;
+      int distSum=candDistSum[c];
+      int minDist=candMinDist[c];
+      for (int i=firstNewEntry; i<img.num_palette; ++i)
+      {
+        int dist=(red-img.palette[i].red);
+        dist*=dist;
+        int temp=(green-img.palette[i].green);
+        dist+=temp*temp;
+        temp=(blue-img.palette[i].blue);
+        dist+=temp*temp;
+        if (dist<minDist) minDist=dist;
+        distSum+=dist;
+      };
+      candDistSum[c]=distSum;
+      candMinDist[c]=minDist;
+      
+      if (minDist>mdqMinDist || (minDist==mdqMinDist && (distSum>mdqDistSum || 
+          (distSum==mdqDistSum && quad%buckets<colors.quad[candidates[mostDifferent]]%buckets))))
+      {
+        mostDifferent=c;
+        mdqMinDist=minDist;
+        mdqDistSum=distSum;
+      };
+    };
+    firstNewEntry=img.num_palette;
+    buckets=colorMapBuckets(numElements+1);
+    
+    if (mdqMinDist>0) //if we have found a most different quad, add it to the palette
+    {                  //and map it to the new palette entry
+      unsigned int mostDifferentQuad=colors.quad[candidates[mostDifferent]];
+      int palentry=img.num_palette;
+      img.palette[palentry].red=mostDifferentQuad&255;
+      img.palette[palentry].green=(mostDifferentQuad>>8)&255;
+      img.palette[palentry].blue=(mostDifferentQuad>>16)&255;
+      colors.palEntry[candidates[mostDifferent]]=palentry;
+      ++img.num_palette;
+    }
+    else break; //otherwise (i.e. all quads are mapped) the palette is finished
+  };
+};
+
+namespace {
+
+//a box of median cut, i.e. the range [lo,hi) of the sorted candidate array
+struct median_cut_box
+{
+  int lo, hi;
+  int axis;      //component (0=red, 1=green, 2=blue) with the largest range
+  double error;  //pixel-weighted sum of quadratic distances to the box's mean
+  long long weight;
+  long long sum[3];
+};
+
+};
+
+//computes all members of box except lo and hi from the colors in [lo,hi)
+static void measureBox(median_cut_box& box, const vector<unsigned int>& cand, const color_table& colors)
+{
+  int minCol[3]={255,255,255};
+  int maxCol[3]={0,0,0};
+  double sum2=0;
+  box.weight=0;
+  box.sum[0]=box.sum[1]=box.sum[2]=0;
+  for (int i=box.lo; i<box.hi; ++i)
+  {
+    unsigned int quad=colors.quad[cand[i]];
+    long long w=colors.count[cand[i]];
+    for (int a=0; a<3; ++a)
+    {
+      int col=(quad>>(8*a))&255;
+      if (col<minCol[a]) minCol[a]=col;
+      if (col>maxCol[a]) maxCol[a]=col;
+      box.sum[a]+=w*col;
+      sum2+=(double)w*col*col;
+    };
+    box.weight+=w;
+  };
+  
+  box.axis=0;
+  for (int a=1; a<3; ++a)
+    if (maxCol[a]-minCol[a]>maxCol[box.axis]-minCol[box.axis]) box.axis=a;
+  
+  box.error=0;
+  if (box.weight>0)
+  {
+    double s=(double)box.sum[0]*box.sum[0]+(double)box.sum[1]*box.sum[1]+(double)box.sum[2]*box.sum[2];
+    box.error=sum2-s/box.weight;
+  };
+};
+
+namespace {
+
+//orders indexes into a color_table by one color component, then by quad
+struct ComponentLess
+{
+  const color_table& colors;
+  int shift;
+  ComponentLess(const color_table& c, int axis):colors(c),shift(8*axis){};
+  bool operator()(unsigned int a, unsigned int b) const 
+  {
+    unsigned int ca=(colors.quad[a]>>shift)&255;
+    unsigned int cb=(colors.quad[b]>>shift)&255;
+    return ca<cb || (ca==cb && colors.quad[a]<colors.quad[b]);
+  };
+};
+
+};
+
+void MedianCutQuantizer::choosePalette(png_data& img, color_table& colors) const
+{
+  vector<unsigned int>& cand=threadScratch().candidates; //indexes into colors
+  cand.clear();
+  for (unsigned c=0; c<colors.size(); ++c)
+  {
+    if (colors.palEntry[c]<0) cand.push_back(c);
+  };
+  
+  int maxBoxes=img.requested_colors-img.num_palette;
+  if (cand.empty() || maxBoxes<=0) return;
+  
+  median_cut_box boxes[256];
+  int numBoxes=1;
+  boxes[0].lo=0;
+  boxes[0].hi=cand.size();
+  measureBox(boxes[0],cand,colors);
+  
+  while(numBoxes<maxBoxes)
+  {
+    int split=-1;
+    for (int b=0; b<numBoxes; ++b)
+    {
+      if (boxes[b].hi-boxes[b].lo<2) continue;
+      if (split<0 || boxes[b].error>boxes[split].error) split=b;
+    };
+    if (split<0) break; //every box contains only a single color
+    
+    median_cut_box box=boxes[split];
+    sort(cand.begin()+box.lo,cand.begin()+box.hi,ComponentLess(colors,box.axis));
+    
+    //find the first index at which half of the box's pixels lie below
+    long long half=(box.weight+1)/2;
+    long long below=0;
+    int mid=box.lo;
+    while(mid<box.hi-1 && below+colors.count[cand[mid]]<half)
+    {
+      below+=colors.count[cand[mid]];
+      ++mid;
+    };
+    ++mid; //the median color belongs to the lower half
+    if (mid>=box.hi) mid=box.hi-1;
+    
+    median_cut_box upper;
+    upper.lo=mid;
+    upper.hi=box.hi;
+    box.hi=mid;
+    measureBox(box,cand,colors);
+    measureBox(upper,cand,colors);
+    boxes[split]=box;
+    boxes[numBoxes++]=upper;
+  };
+  
+  for (int b=0; b<numBoxes; ++b)
+  {
+    long long w=boxes[b].weight;
+    if (w<=0) continue;
+    int palentry=img.num_palette++;
+    img.palette[palentry].red=(boxes[b].sum[0]+w/2)/w;
+    img.palette[palentry].green=(boxes[b].sum[1]+w/2)/w;
+    img.palette[palentry].blue=(boxes[b].sum[2]+w/2)/w;
+  };
+};
+
+//The histogram of WuQuantizer has 32 cells per component plus a leading row of
+//zeroes that makes the cumulative moments easier to compute.
+const int wu_side=33;
+
+static inline int wuIndex(int r, int g, int b)
+{
+  return (r*wu_side+g)*wu_side+b;
+};
+
+namespace {
+
+//box with lower corner (r0,g0,b0) exclusive and upper corner (r1,g1,b1) inclusive
+struct wu_box
+{
+  int r0, r1, g0, g1, b0, b1;
+};
+
+//cumulative moments for WuQuantizer
+struct wu_moments
+{
+  vector<long long> &wt, &mr, &mg, &mb;
+  vector<double>& m2;
+  //uses the buffers of scratch, which are cleared to cover the whole color cube
+  wu_moments(scratch_buffers& scratch):wt(scratch.wuWeight),mr(scratch.wuRed),mg(scratch.wuGreen),
+                                        mb(scratch.wuBlue),m2(scratch.wuSquares)
+  {
+    const int size=wu_side*wu_side*wu_side;
+    wt.assign(size,0);
+    mr.assign(size,0);
+    mg.assign(size,0);
+    mb.assign(size,0);
+    m2.assign(size,0);
+  };
+};
+
+};
+
+template<class T> static T wuVolume(const wu_box& box, const vector<T>& m)
+{
+  return m[wuIndex(box.r1,box.g1,box.b1)]-m[wuIndex(box.r1,box.g1,box.b0)]
+        -m[wuIndex(box.r1,box.g0,box.b1)]+m[wuIndex(box.r1,box.g0,box.b0)]
+        -m[wuIndex(box.r0,box.g1,box.b1)]+m[wuIndex(box.r0,box.g1,box.b0)]
+        +m[wuIndex(box.r0,box.g0,box.b1)]-m[wuIndex(box.r0,box.g0,box.b0)];
+};
+
+//part of wuVolume() that does not depend on the box's upper bound along axis dir
+static long long wuBottom(const wu_box& box, int dir, const vector<long long>& m)
+{
+  switch(dir)
+  {
+    case 0: return -m[wuIndex(box.r0,box.g1,box.b1)]+m[wuIndex(box.r0,box.g1,box.b0)]
+                   +m[wuIndex(box.r0,box.g0,box.b1)]-m[wuIndex(box.r0,box.g0,box.b0)];
+    case 1: return -m[wuIndex(box.r1,box.g0,box.b1)]+m[wuIndex(box.r1,box.g0,box.b0)]
+                   +m[wuIndex(box.r0,box.g0,box.b1)]-m[wuIndex(box.r0,box.g0,box.b0)];
+    default:return -m[wuIndex(box.r1,box.g1,box.b0)]+m[wuIndex(box.r1,box.g0,box.b0)]
+                   +m[wuIndex(box.r0,box.g1,box.b0)]-m[wuIndex(box.r0,box.g0,box.b0)];
+  };
+};
+
+//part of wuVolume() that depends on the box's upper bound pos along axis dir
+static long long wuTop(const wu_box& box, int dir, int pos, const vector<long long>& m)
+{
+  switch(dir)
+  {
+    case 0: return m[wuIndex(pos,box.g1,box.b1)]-m[wuIndex(pos,box.g1,box.b0)]
+                  -m[wuIndex(pos,box.g0,box.b1)]+m[wuIndex(pos,box.g0,box.b0)];
+    case 1: return m[wuIndex(box.r1,pos,box.b1)]-m[wuIndex(box.r1,pos,box.b0)]
+                  -m[wuIndex(box.r0,pos,box.b1)]+m[wuIndex(box.r0,pos,box.b0)];
+    default:return m[wuIndex(box.r1,box.g1,pos)]-m[wuIndex(box.r1,box.g0,pos)]
+                  -m[wuIndex(box.r0,box.g1,pos)]+m[wuIndex(box.r0,box.g0,pos)];
+  };
+};
+
+//returns the pixel-weighted variance of the colors in box
+static double wuVariance(const wu_box& box, const wu_moments& mom)
+{
+  double dr=wuVolume(box,mom.mr);
+  double dg=wuVolume(box,mom.mg);
+  double db=wuVolume(box,mom.mb);
+  double w=wuVolume(box,mom.wt);
+  if (w<=0) return 0;
+  return wuVolume(box,mom.m2)-(dr*dr+dg*dg+db*db)/w;
+};
+
+//finds the cut of box along axis dir in [first,last) that maximizes the sum of the
+//two halves' squared means times weight (i.e. minimizes their summed variance).
+//Stores the cut position in cut (-1 if there is no valid cut) and returns the sum.
+static double wuMaximize(const wu_box& box, int dir, int first, int last, int& cut, const wu_moments& mom,
+                         long long wholeR, long long wholeG, long long wholeB, long long wholeW)
+{
+  long long baseR=wuBottom(box,dir,mom.mr);
+  long long baseG=wuBottom(box,dir,mom.mg);
+  long long baseB=wuBottom(box,dir,mom.mb);
+  long long baseW=wuBottom(box,dir,mom.wt);
+  double max=0;
+  cut=-1;
+  for (int i=first; i<last; ++i)
+  {
+    long long halfR=baseR+wuTop(box,dir,i,mom.mr);
+    long long halfG=baseG+wuTop(box,dir,i,mom.mg);
+    long long halfB=baseB+wuTop(box,dir,i,mom.mb);
+    long long halfW=baseW+wuTop(box,dir,i,mom.wt);
+    if (halfW==0) continue;
+    double temp=((double)halfR*halfR+(double)halfG*halfG+(double)halfB*halfB)/halfW;
+    
+    halfR=wholeR-halfR;
+    halfG=wholeG-halfG;
+    halfB=wholeB-halfB;
+    halfW=wholeW-halfW;
+    if (halfW==0) continue;
+    temp+=((double)halfR*halfR+(double)halfG*halfG+(double)halfB*halfB)/halfW;
+    
+    if (temp>max) { max=temp; cut=i; };
+  };
+  return max;
+};
+
+//splits box1 into box1 and box2. Returns false if box1 can not be split.
+static bool wuCut(wu_box& box1, wu_box& box2, const wu_moments& mom)
+{
+  long long wholeR=wuVolume(box1,mom.mr);
+  long long wholeG=wuVolume(box1,mom.mg);
+  long long wholeB=wuVolume(box1,mom.mb);
+  long long wholeW=wuVolume(box1,mom.wt);
+  
+  int cutR, cutG, cutB;
+  double maxR=wuMaximize(box1,0,box1.r0+1,box1.r1,cutR,mom,wholeR,wholeG,wholeB,wholeW);
+  double maxG=wuMaximize(box1,1,box1.g0+1,box1.g1,cutG,mom,wholeR,wholeG,wholeB,wholeW);
+  double maxB=wuMaximize(box1,2,box1.b0+1,box1.b1,cutB,mom,wholeR,wholeG,wholeB,wholeW);
+  
+  box2.r1=box1.r1;
+  box2.g1=box1.g1;
+  box2.b1=box1.b1;
+  if (maxR>=maxG && maxR>=maxB)
+  {
+    if (cutR<0) return false;
+    box2.r0=box1.r1=cutR;
+    box2.g0=box1.g0;
+    box2.b0=box1.b0;
+  }
+  else if (maxG>=maxR && maxG>=maxB)
+  {
+    box2.g0=box1.g1=cutG;
+    box2.r0=box1.r0;
+    box2.b0=box1.b0;
+  }
+  else
+  {
+    box2.b0=box1.b1=cutB;
+    box2.r0=box1.r0;
+    box2.g0=box1.g0;
+  };
+  return true;
+};
+
+void WuQuantizer::choosePalette(png_data& img, color_table& colors) const
+{
+  int maxBoxes=img.requested_colors-img.num_palette;
+  if (maxBoxes<=0) return;
+  
+  //histogram
+  wu_moments mom(threadScratch());
+  for (unsigned c=0; c<colors.size(); ++c)
+  {
+    if (colors.palEntry[c]>=0) continue;
+    unsigned int quad=colors.quad[c];
+    int red=quad&255;
+    int green=(quad>>8)&255;
+    int blue=(quad>>16)&255;
+    long long w=colors.count[c];
+    int ind=wuIndex((red>>3)+1,(green>>3)+1,(blue>>3)+1);
+    mom.wt[ind]+=w;
+    mom.mr[ind]+=w*red;
+    mom.mg[ind]+=w*green;
+    mom.mb[ind]+=w*blue;
+    mom.m2[ind]+=(double)w*(red*red+green*green+blue*blue);
+  };
+  
+  //cumulative moments, i.e. m[r][g][b] is the sum over all cells <=r,<=g,<=b
+  for (int r=1; r<wu_side; ++r)
+  {
+    long long areaW[wu_side], areaR[wu_side], areaG[wu_side], areaB[wu_side];
+    double area2[wu_side];
+    for (int b=0; b<wu_side; ++b)
+    {
+      areaW[b]=areaR[b]=areaG[b]=areaB[b]=0;
+      area2[b]=0;
+    };
+    
+    for (int g=1; g<wu_side; ++g)
+    {
+      long long lineW=0, lineR=0, lineG=0, lineB=0;
+      double line2=0;
+      for (int b=1; b<wu_side; ++b)
+      {
+        int ind=wuIndex(r,g,b);
+        int prev=wuIndex(r-1,g,b);
+        lineW+=mom.wt[ind];
+        lineR+=mom.mr[ind];
+        lineG+=mom.mg[ind];
+        lineB+=mom.mb[ind];
+        line2+=mom.m2[ind];
+        areaW[b]+=lineW;
+        areaR[b]+=lineR;
+        areaG[b]+=lineG;
+        areaB[b]+=lineB;
+        area2[b]+=line2;
+        mom.wt[ind]=mom.wt[prev]+areaW[b];
+        mom.mr[ind]=mom.mr[prev]+areaR[b];
+        mom.mg[ind]=mom.mg[prev]+areaG[b];
+        mom.mb[ind]=mom.mb[prev]+areaB[b];
+        mom.m2[ind]=mom.m2[prev]+area2[b];
+      };
+    };
+  };
+  
+  wu_box boxes[256];
+  double variance[256];
+  variance[0]=0;
+  boxes[0].r0=boxes[0].g0=boxes[0].b0=0;
+  boxes[0].r1=boxes[0].g1=boxes[0].b1=wu_side-1;
+  int numBoxes=1;
+  int next=0;
+  while(numBoxes<maxBoxes)
+  {
+    if (wuCut(boxes[next],boxes[numBoxes],mom))
+    {
+      variance[next]=wuVariance(boxes[next],mom);
+      variance[numBoxes]=wuVariance(boxes[numBoxes],mom);
+      ++numBoxes;
+    }
+    else variance[next]=0; //box can not be split any further
+    
+    next=0;
+    for (int b=1; b<numBoxes; ++b)
+      if (variance[b]>variance[next]) next=b;
+    
+    if (variance[next]<=0) break;
+  };
+  
+  for (int b=0; b<numBoxes; ++b)
+  {
+    long long w=wuVolume(boxes[b],mom.wt);
+    if (w<=0) continue;
+    int palentry=img.num_palette++;
+    img.palette[palentry].red=(wuVolume(boxes[b],mom.mr)+w/2)/w;
+    img.palette[palentry].green=(wuVolume(boxes[b],mom.mg)+w/2)/w;
+    img.palette[palentry].blue=(wuVolume(boxes[b],mom.mb)+w/2)/w;
+  };
+};
+
+//returns the Quantizer called name or NULL if there is none
+static const Quantizer* findQuantizer(const char* name)
+{
+  if (strcmp(name,"farthest")==0) return &farthestPointQuantizer;
+  if (strcmp(name,"mediancut")==0) return &medianCutQuantizer;
+  if (strcmp(name,"wu")==0) return &wuQuantizer;
+  return NULL;
+};
+
+//adds colors.quad[c] to the palette of img unchanged and maps it to the new entry
+static void addExactColor(png_data& img, color_table& colors, unsigned c)
+{
+  unsigned int quad=colors.quad[c];
+  int palentry=img.num_palette++;
+  img.palette[palentry].red=quad&255;
+  img.palette[palentry].green=(quad>>8)&255;
+  img.palette[palentry].blue=(quad>>16)&255;
+  colors.palEntry[c]=palentry;
+};
+
+//If all colors of img that are not mapped yet fit into the free palette entries,
+//adds them to the palette unchanged and returns true, so that no quantization is
+//necessary. The colors of an indexed image keep the order of its PNG palette.
+static bool useExactColors(png_data& img, color_table& colors)
+{
+  int numUnmapped=0;
+  for (unsigned c=0; c<colors.size(); ++c)
+    if (colors.palEntry[c]<0) ++numUnmapped;
+  
+  if (numUnmapped>img.requested_colors-img.num_palette) return false;
+  
+  if (img.indexed)
+  {
+    for (int i=0; i<256; ++i)
+    {
+      unsigned c=colors.find(img.indexQuad[i]);
+      if (c<colors.size() && colors.quad[c]==img.indexQuad[i] && colors.palEntry[c]<0) 
+        addExactColor(img,colors,c);
+    };
+  };
+  
+  for (unsigned c=0; c<colors.size(); ++c)
+    if (colors.palEntry[c]<0) addExactColor(img,colors,c);
+  
+  return true;
+};
+
+//Chooses the palette of img and maps every color in img.colors to an entry of it.
+//returns true if color reduction resulted in at least one of the image's colors 
+//being mapped to a palette color with a quadratic distance of more than
+//color_reduce_warning_threshold
+//If img.source has stats, the times of both phases and the mapping distances are
+//stored in them.
+bool convertToIndexed(png_data& img)
+{
+  png2ico_stats* stats=img.source->stats;
+  Stopwatch paletteStopwatch(stats!=NULL ? &stats->palette : NULL);
+  color_table& colors=img.colors;
+  img.num_palette=0;
+  
+  //(non-transparent) black and white always get an entry in colors (see below),
+  //even if no pixel has them
+  const unsigned int blackWhite[2]={255u<<24, 255u+(255u<<8)+(255u<<16)+(255u<<24)};
+  for (int bw=0; bw<2; ++bw)
+  {
+    unsigned int c=colors.find(blackWhite[bw]);
+    if (c==colors.size() || colors.quad[c]!=blackWhite[bw])
+    {
+      colors.quad.insert(colors.quad.begin()+c,blackWhite[bw]);
+      colors.count.insert(colors.count.begin()+c,0);
+      colors.palEntry.insert(colors.palEntry.begin()+c,-1);
+    };
+  };
+  
+  //always allocate entry 0 to black and entry 1 to white because
+  //sometimes AND mask is interpreted as color index
+  img.num_palette=2;
+  img.palette[0].red=0;
+  img.palette[0].green=0;
+  img.palette[0].blue=0;
+  img.palette[1].red=255;
+  img.palette[1].green=255;
+  img.palette[1].blue=255;
+  
+  colors.palEntry[colors.find(blackWhite[0])]=0; //map (non-transparent) black to entry 0
+  colors.palEntry[colors.find(blackWhite[1])]=1; //map (non-transparent) white to entry 1
+  
+  //images that have few enough colors do not need color reduction
+  if (useExactColors(img,colors)) return false;
+  
+  //Now fill up the palette
+  img.quantizer->choosePalette(img,colors);
+  paletteStopwatch.stop();
+
+  //Now map all yet unmapped colors to the most appropriate palette entry
+  Stopwatch mappingStopwatch(stats!=NULL ? &stats->mapping : NULL);
+  PaletteTree paletteTree(img.palette,img.num_palette);
+  for (unsigned c=0; c<colors.size(); ++c)
+  {
+    if (colors.palEntry[c]<0)
+    {
+      unsigned int quad=colors.quad[c];
+      colors.palEntry[c]=paletteTree.nearest(quad&255,(quad>>8)&255,(quad>>16)&255); 
+    };
+  };
+  
+  //Adjust all palette entries (except for 0 and 1) to be the mean of all
+  //colors mapped to it
+  adjustPaletteToMeans(img,colors);
+  
+  //If requested, refine the palette with a few rounds of k-means (Lloyd's algorithm),
+  //i.e. map every non-transparent color to the closest entry of the adjusted
+  //palette and then adjust the palette again. Stop early when no mapping changes.
+  for (int round=0; round<img.refine_iterations; ++round)
+  {
+    PaletteTree refineTree(img.palette,img.num_palette);
+    bool changed=false;
+    for (unsigned c=0; c<colors.size(); ++c)
+    {
+      unsigned int quad=colors.quad[c];
+      if ((quad>>24)!=0) //if color is not transparent
+      {
+        int palentry=refineTree.nearest(quad&255,(quad>>8)&255,(quad>>16)&255);
+        if (palentry!=colors.palEntry[c])
+        {
+          colors.palEntry[c]=palentry;
+          changed=true;
+        };
+      };
+    };
+    
+    if (!changed) break;
+    adjustPaletteToMeans(img,colors);
+  };
+
+  //Now determine if a non-transparent source color got mapped to a target color that 
+  //has a distance that exceeds the threshold
+  bool tooManyColors=false;
+  int maxDist=0;
+  double sumDist=0;
+  double numPixels=0;
+  for (unsigned c=0; c<colors.size(); ++c)
+  {
+    unsigned int quad=colors.quad[c];
+    if ((quad>>24)!=0) //if color is not transparent
+    {
+      int red=quad&255;
+      int green=(quad>>8)&255;
+      int blue=(quad>>16)&255;
+      int i=colors.palEntry[c];
+      int dist=(red-img.palette[i].red);
+      dist*=dist;
+      int temp=(green-img.palette[i].green);
+      dist+=temp*temp;
+      temp=(blue-img.palette[i].blue);
+      dist+=temp*temp;
+      if (dist>color_reduce_warning_threshold) tooManyColors=true;
+      maxDist=max(maxDist,dist);
+      sumDist+=(double)dist*colors.count[c];
+      numPixels+=colors.count[c];
+    };
+  };
+  
+  if (stats!=NULL)
+  {
+    stats->max_distance=maxDist;
+    stats->mean_distance=(numPixels>0 ? sumDist/numPixels : 0);
+  };
+  return tooManyColors;
+};
+
+//packs a line of width pixels (1 byte per pixel) in row, with 8/nbits pixels packed
+//into each byte, and stores the result at out
+//returns the number of bytes stored at out
+int pack(png_const_bytep row,int width,int nbits,png_bytep out)
+{
+  int pixelsPerByte=8/nbits;
+  if (pixelsPerByte<=1) 
+  {
+    memcpy(out,row,width);
+    return width;
+  };
+  int ander=(1<<nbits)-1;
+  int outByte=0;
+  int count=0;
+  int outIndex=0;
+  for (int i=0; i<width; ++i)
+  {
+    outByte+=(row[i]&ander);
+    if (++count==pixelsPerByte) 
+    {
+      out[outIndex]=outByte;
+      count=0;
+      ++outIndex;
+      outByte=0;
+    };
+    outByte<<=nbits;
+  };
+
+  if (count>0) 
+  {
+    outByte<<=nbits*(pixelsPerByte-count-1); //outByte has already been shifted for the last pixel
+    out[outIndex]=outByte;
+    ++outIndex;
+  };  
+  
+  return outIndex;
+};
+
+//Stores the AND mask of a line of width RGBA pixels at mask, i.e. 1 bit per pixel
+//that is 1 for transparent pixels, most significant bit first.
+//returns the number of bytes stored at mask
+int alphaMask(png_const_bytep rgba,int width,png_bytep mask)
+{
+  int outIndex=0;
+  for (int i=0; i<width; i+=8)
+  {
+    int bits=0;
+    for (int b=0; b<8; ++b)
+    {
+      bits+=bits;
+      if (i+b<width && rgba[4*(i+b)+3]<transparency_threshold) ++bits;
+    };
+    mask[outIndex++]=bits;
+  };
+  return outIndex;
+};
+
+//The kernels below do the same as pack() and alphaMask() with SSE2 or AVX2 
+//instructions. They are compiled for these instruction sets regardless of the 
+//compiler flags and are only used if rowKernels() finds that the CPU supports them.
+#ifdef PNG2ICO_X86_KERNELS
+
+//reverses the order of the lowest 8 bits of b, because movemask puts the first
+//pixel into the least significant bit while the icon wants it in the most significant bit
+static inline int reverseBits(unsigned int b)
+{
+  return ((((b&255)*0x0802u&0x22110u)|((b&255)*0x8020u&0x88440u))*0x10101u>>16)&255;
+};
+
+__attribute__((target("sse2")))
+int packSSE2(png_const_bytep row,int width,int nbits,png_bytep out)
+{
+  if (nbits>=8) return pack(row,width,nbits,out);
+  
+  int i=0;
+  png_bytep o=out;
+  if (nbits==4)
+  {
+    const __m128i low=_mm_set1_epi16(0x0F);
+    for (; i+32<=width; i+=32, o+=16)
+    {
+      //each 16 bit lane holds 2 pixels, the first one in the low byte
+      __m128i v0=_mm_loadu_si128((const __m128i*)(row+i));
+      __m128i v1=_mm_loadu_si128((const __m128i*)(row+i+16));
+      v0=_mm_or_si128(_mm_slli_epi16(_mm_and_si128(v0,low),4),_mm_and_si128(_mm_srli_epi16(v0,8),low));
+      v1=_mm_or_si128(_mm_slli_epi16(_mm_and_si128(v1,low),4),_mm_and_si128(_mm_srli_epi16(v1,8),low));
+      _mm_storeu_si128((__m128i*)o,_mm_packus_epi16(v0,v1));
+    };
+  }
+  else if (nbits==1)
+  {
+    for (; i+16<=width; i+=16, o+=2)
+    {
+      __m128i v=_mm_slli_epi16(_mm_loadu_si128((const __m128i*)(row+i)),7);
+      int bits=_mm_movemask_epi8(v);
+      o[0]=reverseBits(bits);
+      o[1]=reverseBits(bits>>8);
+    };
+  };
+  
+  return (o-out)+pack(row+i,width-i,nbits,o);
+};
+
+__attribute__((target("sse2")))
+int alphaMaskSSE2(png_const_bytep rgba,int width,png_bytep mask)
+{
+  const __m128i limit=_mm_set1_epi8((char)(transparency_threshold-1));
+  int i=0;
+  png_bytep o=mask;
+  for (; i+16<=width; i+=16, o+=2)
+  {
+    const __m128i* in=(const __m128i*)(rgba+4*i);
+    __m128i a0=_mm_srli_epi32(_mm_loadu_si128(in),24);
+    __m128i a1=_mm_srli_epi32(_mm_loadu_si128(in+1),24);
+    __m128i a2=_mm_srli_epi32(_mm_loadu_si128(in+2),24);
+    __m128i a3=_mm_srli_epi32(_mm_loadu_si128(in+3),24);
+    __m128i alpha=_mm_packus_epi16(_mm_packs_epi32(a0,a1),_mm_packs_epi32(a2,a3));
+    __m128i trans=_mm_cmpeq_epi8(_mm_min_epu8(alpha,limit),alpha); //alpha<=limit
+    int bits=_mm_movemask_epi8(trans);
+    o[0]=reverseBits(bits);
+    o[1]=reverseBits(bits>>8);
+  };
+  
+  return (o-mask)+alphaMask(rgba+4*i,width-i,o);
+};
+
+__attribute__((target("avx2")))
+int packAVX2(png_const_bytep row,int width,int nbits,png_bytep out)
+{
+  if (nbits>=8) return pack(row,width,nbits,out);
+  
+  int i=0;
+  png_bytep o=out;
+  if (nbits==4)
+  {
+    const __m256i low=_mm256_set1_epi16(0x0F);
+    for (; i+64<=width; i+=64, o+=32)
+    {
+      __m256i v0=_mm256_loadu_si256((const __m256i*)(row+i));
+      __m256i v1=_mm256_loadu_si256((const __m256i*)(row+i+32));
+      v0=_mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v0,low),4),_mm256_and_si256(_mm256_srli_epi16(v0,8),low));
+      v1=_mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v1,low),4),_mm256_and_si256(_mm256_srli_epi16(v1,8),low));
+      //packus works on each 128 bit half separately, so the quarters must be reordered
+      __m256i packed=_mm256_permute4x64_epi64(_mm256_packus_epi16(v0,v1),0xD8);
+      _mm256_storeu_si256((__m256i*)o,packed);
+    };
+  }
+  else if (nbits==1)
+  {
+    for (; i+32<=width; i+=32, o+=4)
+    {
+      __m256i v=_mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(row+i)),7);
+      unsigned int bits=_mm256_movemask_epi8(v);
+      o[0]=reverseBits(bits);
+      o[1]=reverseBits(bits>>8);
+      o[2]=reverseBits(bits>>16);
+      o[3]=reverseBits(bits>>24);
+    };
+  };
+  
+  return (o-out)+packSSE2(row+i,width-i,nbits,o);
+};
+
+__attribute__((target("avx2")))
+int alphaMaskAVX2(png_const_bytep rgba,int width,png_bytep mask)
+{
+  const __m256i limit=_mm256_set1_epi8((char)(transparency_threshold-1));
+  const __m256i order=_mm256_setr_epi32(0,4,1,5,2,6,3,7);
+  int i=0;
+  png_bytep o=mask;
+  for (; i+32<=width; i+=32, o+=4)
+  {
+    const __m256i* in=(const __m256i*)(rgba+4*i);
+    __m256i a0=_mm256_srli_epi32(_mm256_loadu_si256(in),24);
+    __m256i a1=_mm256_srli_epi32(_mm256_loadu_si256(in+1),24);
+    __m256i a2=_mm256_srli_epi32(_mm256_loadu_si256(in+2),24);
+    __m256i a3=_mm256_srli_epi32(_mm256_loadu_si256(in+3),24);
+    //the packs work on each 128 bit half separately, which leaves groups of 4 pixels
+    //in the order 0,2,4,6,1,3,5,7
+    __m256i alpha=_mm256_packus_epi16(_mm256_packs_epi32(a0,a1),_mm256_packs_epi32(a2,a3));
+    alpha=_mm256_permutevar8x32_epi32(alpha,order);
+    __m256i trans=_mm256_cmpeq_epi8(_mm256_min_epu8(alpha,limit),alpha); //alpha<=limit
+    unsigned int bits=_mm256_movemask_epi8(trans);
+    o[0]=reverseBits(bits);
+    o[1]=reverseBits(bits>>8);
+    o[2]=reverseBits(bits>>16);
+    o[3]=reverseBits(bits>>24);
+  };
+  
+  return (o-mask)+alphaMaskSSE2(rgba+4*i,width-i,o);
+};
+
+#endif
+
+namespace {
+
+//the versions of the row kernels best suited for the CPU
+struct row_kernels
+{
+  int (*pack)(png_const_bytep row,int width,int nbits,png_bytep out);
+  int (*alphaMask)(png_const_bytep rgba,int width,png_bytep mask);
+};
+
+};
+
+static row_kernels chooseRowKernels()
+{
+  row_kernels kernels;
+  kernels.pack=pack;
+  kernels.alphaMask=alphaMask;
+#ifdef PNG2ICO_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+  {
+    kernels.pack=packSSE2;
+    kernels.alphaMask=alphaMaskSSE2;
+  };
+  if (__builtin_cpu_supports("avx2"))
+  {
+    kernels.pack=packAVX2;
+    kernels.alphaMask=alphaMaskAVX2;
+  };
+#endif
+  return kernels;
+};
+
+static const row_kernels& rowKernels()
+{
+  static const row_kernels kernels=chooseRowKernels();
+  return kernels;
+};
+
+namespace {
+
+//a call of parallelFor() whose calls of func are shared with the WorkerPool
+struct parallel_task
+{
+  void (*func)(void*,int);
+  void* arg;
+  int count;
+  atomic<int> next; //the next n to call func for
+  int helpers;      //number of pool threads that may still join the task
+  int active;       //number of pool threads working on the task
+};
+
+//The threads that help parallelFor(). They are started when they are first needed
+//and then kept until the program exits, so that their scratch_buffers are reused
+//by all following conversions instead of being freed with the thread.
+class WorkerPool
+{
+  public:
+    WorkerPool():stopping(false){};
+    ~WorkerPool();
+    
+    //Calls func for all n of task with the calling thread and up to task.helpers
+    //threads of the pool, which is grown to that many threads if necessary. 
+    //Returns when all calls have finished.
+    void run(parallel_task& task);
+    
+  private:
+    static void runCalls(parallel_task& task);
+    void work();
+    
+    mutex mtx;
+    condition_variable wakeWorker; //a task was added or the pool is stopping
+    condition_variable taskDone;   //a pool thread has left a task
+    vector<parallel_task*> tasks;  //the tasks that still take helpers
+    vector<thread> threads;
+    bool stopping;
+};
+
+};
+
+WorkerPool::~WorkerPool()
+{
+  {
+    lock_guard<mutex> lock(mtx);
+    stopping=true;
+  };
+  wakeWorker.notify_all();
+  for (unsigned t=0; t<threads.size(); ++t) threads[t].join();
+};
+
+void WorkerPool::runCalls(parallel_task& task)
+{
+  for (int n=task.next++; n<task.count; n=task.next++) task.func(task.arg,n);
+};
+
+void WorkerPool::run(parallel_task& task)
+{
+  int helpers=task.helpers; //task.helpers is counted down by the pool threads
+  {
+    lock_guard<mutex> lock(mtx);
+    while ((int)threads.size()<helpers) threads.push_back(thread(&WorkerPool::work,this));
+    tasks.push_back(&task);
+  };
+  for (int h=0; h<helpers; ++h) wakeWorker.notify_one();
+  
+  runCalls(task);
+  
+  //all calls have been started when runCalls() returns, so no more helpers are needed
+  unique_lock<mutex> lock(mtx);
+  vector<parallel_task*>::iterator t=find(tasks.begin(),tasks.end(),&task);
+  if (t!=tasks.end()) tasks.erase(t);
+  while (task.active>0) taskDone.wait(lock);
+};
+
+void WorkerPool::work()
+{
+  unique_lock<mutex> lock(mtx);
+  for(;;)
+  {
+    while (!stopping && tasks.empty()) wakeWorker.wait(lock);
+    if (stopping) return;
+    
+    parallel_task& task=*tasks.front();
+    if (--task.helpers==0) tasks.erase(tasks.begin());
+    ++task.active;
+    lock.unlock();
+    runCalls(task);
+    lock.lock();
+    if (--task.active==0) taskDone.notify_all();
+  };
+};
+
+//Calls func(arg,n) for n=0,...,count-1, distributed over up to numThreads threads:
+//the calling thread and threads of a WorkerPool that lasts as long as the program.
+//Calls of parallelFor() may be nested. Returns when all calls have finished.
+static void parallelFor(int count, int numThreads, void (*func)(void*,int), void* arg)
+{
+  if (numThreads>count) numThreads=count;
+  if (numThreads<=1)
+  {
+    for (int n=0; n<count; ++n) func(arg,n);
+    return;
+  };
+  
+  static WorkerPool pool;
+  parallel_task task;
+  task.func=func;
+  task.arg=arg;
+  task.count=count;
+  task.next=0;
+  task.helpers=numThreads-1;
+  task.active=0;
+  pool.run(task);
+};
+
+//formats a message like printf() with up to 2 string arguments
+static string formatMessage(const char* format, const char* arg1, const char* arg2="")
+{
+  char buf[1024];
+  snprintf(buf,sizeof(buf),format,arg1,arg2);
+  return buf;
+};
+
+namespace {
+
+//state of the libpng read function readFromMemory()
+struct memory_source
+{
+  png_const_bytep data;
+  png_size_t size;
+  png_size_t pos;
+};
+
+};
+
+static void readFromMemory(png_structp png_ptr, png_bytep out, png_size_t length)
+{
+  memory_source* src=(memory_source*)png_get_io_ptr(png_ptr);
+  if (length>src->size-src->pos) png_error(png_ptr,"Read error");
+  memcpy(out,src->data+src->pos,length);
+  src->pos+=length;
+};
+
+//libpng error handler. Stores the message in the string passed to 
+//png_create_read_struct() instead of printing it and jumps back to the setjmp()
+//of the function that called libpng.
+void storePNGError(png_structp png_ptr, png_const_charp msg)
+{
+  *(string*)png_get_error_ptr(png_ptr)=msg;
+  longjmp(png_jmpbuf(png_ptr),1);
+};
+
+void ignorePNGWarning(png_structp, png_const_charp)
+{
+};
+
+namespace {
+
+//the pixel formats a png_reader can deliver
+enum read_format
+{
+  READ_NATIVE, //8 bit RGB or RGBA, palette based images as 1 byte palette indices
+  READ_RGBA,   //8 bit RGBA for all images
+  READ_BGRA    //8 bit BGRA for all images
+};
+
+//Decodes a PNG file in memory row by row, expanded to 8 bit RGB or RGBA, so that
+//only a single row has to be kept in memory. Interlaced images are the exception:
+//their first row is not complete before the last pass, so they are decoded
+//completely when the first row is requested.
+//A png_reader can also read the rows of an rgba_image, so that scaled images can
+//be processed the same way as PNG files.
+struct png_reader
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+  memory_source src;
+  png_const_bytep pixels;   //the rgba_image the rows are read from, NULL for PNG files
+  bool swapRB;              //true if the rows of pixels are delivered as BGRA
+  string error;             //libpng's message if one of the functions below fails
+  png_uint_32 width, height;
+  int color_type;           //color type after the expansion
+  png_size_t rowbytes;      //number of bytes of a decoded row
+  bool interlaced;
+  vector<png_byte> image;   //the whole image if it is interlaced
+  vector<png_bytep> rows;   //pointers to the rows in image
+  png_uint_32 nextRow;      //number of the row returned by the next call of readRow()
+  png2ico_time* decodeTime; //if not NULL, the time spent decoding rows of the PNG file is added to it
+  png_reader():png_ptr(NULL),info_ptr(NULL),pixels(NULL),swapRB(false),width(0),height(0),color_type(0),rowbytes(0),
+               interlaced(false),nextRow(0),decodeTime(NULL){};
+  ~png_reader()
+  {
+    if (png_ptr!=NULL) png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+  };
+};
+
+};
+
+//The following functions return false if libpng fails. In that case reader.error
+//contains libpng's error message.
+//NOTE: They must not create any C++ objects because the setjmp()/longjmp() 
+//error handling would skip their destructors.
+
+//Starts decoding the PNG file at data and reads its header into reader. format is
+//one of read_format.
+static bool openPNG(png_reader& reader, const void* data, size_t size, int format=READ_NATIVE)
+{
+  reader.src.data=(png_const_bytep)data;
+  reader.src.size=size;
+  reader.src.pos=0;
+  
+  reader.png_ptr=png_create_read_struct
+                   (PNG_LIBPNG_VER_STRING, &reader.error, storePNGError, ignorePNGWarning);
+  if (!reader.png_ptr)
+  {
+    reader.error="png_create_read_struct error";
+    return false;
+  };  
+
+  reader.info_ptr=png_create_info_struct(reader.png_ptr);
+  if (!reader.info_ptr)
+  {
+    reader.error="png_create_info_struct error";
+    return false;
+  };
+  
+  if (setjmp(png_jmpbuf(reader.png_ptr))) return false;
+  
+  png_set_read_fn(reader.png_ptr, &reader.src, readFromMemory);
+  png_read_info(reader.png_ptr, reader.info_ptr);
+  
+  //the same transformations as PNG_TRANSFORM_PACKING|PNG_TRANSFORM_STRIP_16|PNG_TRANSFORM_EXPAND
+  //except that READ_NATIVE keeps palette indices
+  png_set_packing(reader.png_ptr);
+  png_set_strip_16(reader.png_ptr);
+  int color_type=png_get_color_type(reader.png_ptr, reader.info_ptr);
+  if (format!=READ_NATIVE || color_type!=PNG_COLOR_TYPE_PALETTE)
+    png_set_expand(reader.png_ptr);
+  if (format!=READ_NATIVE)
+  {
+    png_set_gray_to_rgb(reader.png_ptr);
+    if ((color_type & PNG_COLOR_MASK_ALPHA)==0) png_set_add_alpha(reader.png_ptr, 0xff, PNG_FILLER_AFTER);
+    if (format==READ_BGRA) png_set_bgr(reader.png_ptr);
+  };
+  reader.interlaced=(png_set_interlace_handling(reader.png_ptr)>1);
+  png_read_update_info(reader.png_ptr, reader.info_ptr);
+  
+  reader.width=png_get_image_width(reader.png_ptr, reader.info_ptr);
+  reader.height=png_get_image_height(reader.png_ptr, reader.info_ptr);
+  reader.color_type=png_get_color_type(reader.png_ptr, reader.info_ptr);
+  reader.rowbytes=png_get_rowbytes(reader.png_ptr, reader.info_ptr);
+  return true;
+};
+
+//decodes the next row of a non-interlaced image into row
+static bool decodeRow(png_reader& reader, png_bytep row)
+{
+  if (setjmp(png_jmpbuf(reader.png_ptr))) return false;
+  png_read_row(reader.png_ptr, row, NULL);
+  return true;
+};
+
+//decodes the whole interlaced image into reader.rows
+static bool decodeImage(png_reader& reader)
+{
+  if (setjmp(png_jmpbuf(reader.png_ptr))) return false;
+  png_read_image(reader.png_ptr, &reader.rows[0]);
+  return true;
+};
+
+//Prepares reader to deliver the rows of image in the given read_format.
+static void openPixels(png_reader& reader, const rgba_image& image, int format)
+{
+  reader.pixels=image.pixels.empty() ? NULL : &image.pixels[0];
+  reader.swapRB=(format==READ_BGRA);
+  reader.width=image.width;
+  reader.height=image.height;
+  reader.color_type=PNG_COLOR_TYPE_RGB_ALPHA;
+  reader.rowbytes=4*image.width;
+};
+
+//Returns the next row of the image. Rows of non-interlaced images are decoded (and 
+//rows of an rgba_image converted to BGRA) into buf, which must have room for 
+//reader.rowbytes bytes. Returns NULL if libpng fails.
+static png_const_bytep readRow(png_reader& reader, png_bytep buf)
+{
+  if (reader.pixels!=NULL)
+  {
+    png_const_bytep row=reader.pixels+reader.rowbytes*reader.nextRow++;
+    if (!reader.swapRB) return row;
+    for (png_size_t i=0; i<reader.rowbytes; i+=4)
+    {
+      buf[i]=row[i+2];
+      buf[i+1]=row[i+1];
+      buf[i+2]=row[i];
+      buf[i+3]=row[i+3];
+    };
+    return buf;
+  };
+  
+  Stopwatch stopwatch(reader.decodeTime);
+  if (!reader.interlaced)
+  {
+    if (!decodeRow(reader,buf)) return NULL;
+    ++reader.nextRow;
+    return buf;
+  };
+  
+  if (reader.rows.empty())
+  {
+    reader.image.resize(reader.rowbytes*reader.height);
+    reader.rows.resize(reader.height);
+    for (png_uint_32 y=0; y<reader.height; ++y) reader.rows[y]=&reader.image[reader.rowbytes*y];
+    if (!decodeImage(reader)) return NULL;
+  };
+  
+  return reader.rows[reader.nextRow++];
+};
+
+//Prepares reader to deliver the rows of img in the given read_format, either from
+//img.pixels if the image is scaled or decoded from its PNG file.
+static bool openImage(png_reader& reader, const png_data& img, int format)
+{
+  if (img.pixels)
+  {
+    openPixels(reader,*img.pixels,format);
+    return true;
+  };
+  if (img.source->stats!=NULL) reader.decodeTime=&img.source->stats->decode;
+  Stopwatch stopwatch(reader.decodeTime);
+  return openPNG(reader,img.source->png,img.source->png_size,format);
+};
+
+//Stores the colors of the PNG palette of a palette based image in img.indexQuad in
+//the same form as pixelQuad() would return them after expansion to RGBA.
+static void readPalette(png_data& img, png_reader& reader)
+{
+  png_colorp pal=NULL;
+  int num_pal=0;
+  png_bytep trans_alpha=NULL;
+  int num_trans=0;
+  png_get_PLTE(reader.png_ptr, reader.info_ptr, &pal, &num_pal);
+  png_get_tRNS(reader.png_ptr, reader.info_ptr, &trans_alpha, &num_trans, NULL);
+  
+  //libpng expands indices without a palette entry to opaque black
+  for (int i=0; i<256; ++i) img.indexQuad[i]=(255u<<24);
+  for (int i=0; i<num_pal && i<256; ++i)
+  {
+    bool trans=(i<num_trans && trans_alpha[i]<transparency_threshold);
+    if (trans) 
+      img.indexQuad[i]=0;
+    else
+      img.indexQuad[i]=pal[i].red+(pal[i].green<<8)+(pal[i].blue<<16)+(255u<<24);
+  };
+};
+
+//returns the color of pixel as stored in color_table (i.e. 0 for transparent pixels)
+static inline unsigned int pixelQuad(png_const_bytep pixel, bool trans)
+{
+  if (trans) return 0;
+  return pixel[0]+(pixel[1]<<8)+(pixel[2]<<16)+(255u<<24);
+};
+
+namespace {
+
+//Gathers the colors of an image into a color_table. Runs of equal pixels are
+//buffered as (quad,count) pairs, which are sorted and merged into the table
+//whenever the buffer is full. This way the memory needed depends on the number
+//of different colors rather than on the number of pixels.
+class ColorCollector
+{
+    color_table& table;
+    vector<unsigned long long>& runs; //quad<<32 + number of pixels
+    unsigned int runQuad;
+    unsigned int runLength;
+    
+    void flush();
+    
+  public:
+    //only one ColorCollector per thread may be in use at a time, because they share the scratch_buffers
+    ColorCollector(color_table& colors):table(colors),runs(threadScratch().runs),runQuad(0),runLength(0) 
+    {
+      runs.clear();
+    };
+    
+    //adds count pixels of color quad
+    void add(unsigned int quad, unsigned int count=1)
+    {
+      if (runLength>0 && quad==runQuad) { runLength+=count; return; };
+      if (runLength>0) 
+      {
+        runs.push_back(((unsigned long long)runQuad<<32)+runLength);
+        //let the buffer grow with the table so that merging does not become quadratic
+        if (runs.size()>=65536 && runs.size()>=table.size()) flush();
+      };
+      runQuad=quad;
+      runLength=count;
+    };
+    
+    //Stores the remaining colors in the table. Transparent colors are mapped to
+    //palette entry 0, all other colors are not mapped yet.
+    void finish();
+};
+
+};
+
+void ColorCollector::flush()
+{
+  sort(runs.begin(),runs.end());
+  //the merged table takes the place of table, whose buffers are kept for the next flush()
+  color_table& merged=threadScratch().merged;
+  merged.quad.clear();
+  merged.count.clear();
+  merged.quad.reserve(table.size()+runs.size());
+  merged.count.reserve(table.size()+runs.size());
+  unsigned c=0;
+  for (unsigned r=0; r<runs.size(); )
+  {
+    unsigned int quad=runs[r]>>32;
+    while(c<table.size() && table.quad[c]<quad)
+    {
+      merged.quad.push_back(table.quad[c]);
+      merged.count.push_back(table.count[c]);
+      ++c;
+    };
+    
+    unsigned int count=0;
+    if (c<table.size() && table.quad[c]==quad) count=table.count[c++];
+    while(r<runs.size() && (runs[r]>>32)==quad) count+=(runs[r++]&0xFFFFFFFFu);
+    merged.quad.push_back(quad);
+    merged.count.push_back(count);
+  };
+  
+  merged.quad.insert(merged.quad.end(),table.quad.begin()+c,table.quad.end());
+  merged.count.insert(merged.count.end(),table.count.begin()+c,table.count.end());
+  table.quad.swap(merged.quad);
+  table.count.swap(merged.count);
+  runs.clear();
+};
+
+void ColorCollector::finish()
+{
+  if (runLength>0) runs.push_back(((unsigned long long)runQuad<<32)+runLength);
+  runLength=0;
+  flush();
+  
+  table.palEntry.resize(table.size());
+  for (unsigned c=0; c<table.size(); ++c)
+    table.palEntry[c]=((table.quad[c]>>24)==0) ? 0 : -1;
+};
+
+//First pass over the image: gathers all colors of img into img.colors. If the image
+//has an alpha channel, all transparent pixels are counted as RGBA (0,0,0,0) and all
+//other pixels as opaque.
+//bytesPerPixel is 4 for RGBA, 3 for RGB and 1 for palette based images, whose 
+//pixels are only counted per index. 
+template<int bytesPerPixel> static bool gatherColors(png_data& img, png_reader& reader)
+{
+  const bool hasAlpha=(bytesPerPixel==4);
+  
+  vector<png_byte>& buf=threadScratch().rows;
+  buf.resize(reader.rowbytes);
+  unsigned int indexCount[256];
+  memset(indexCount,0,sizeof(indexCount));
+  ColorCollector collector(img.colors);
+  for (png_uint_32 y=0; y<img.height; ++y)
+  {
+    png_const_bytep pixel=readRow(reader,&buf[0]);
+    if (pixel==NULL) return false;
+    
+    for (unsigned i=0; i<img.width; ++i)
+    {
+      if (bytesPerPixel==1)
+        ++indexCount[pixel[i]];
+      else
+      {
+        collector.add(pixelQuad(pixel,checkTransparent<hasAlpha>(pixel)));
+        pixel+=bytesPerPixel;
+      };
+    };
+  };
+  
+  for (int i=0; bytesPerPixel==1 && i<256; ++i)
+    if (indexCount[i]>0) collector.add(img.indexQuad[i],indexCount[i]);
+  
+  collector.finish();
+  return true;
+};
+
+//returns gatherColors() for the pixel format of img
+static bool gatherColors(png_data& img, png_reader& reader)
+{
+  if (img.indexed) return gatherColors<1>(img,reader);
+  if (img.hasAlpha) return gatherColors<4>(img,reader);
+  return gatherColors<3>(img,reader);
+};
+
+//Returns the number of bands of rows img is split into, so that numThreads threads
+//can work on it. Only images whose pixels are in memory can be split, because
+//libpng decodes the rows of a PNG file one after the other.
+static int numBands(const png_data& img, int numThreads)
+{
+  if (!img.pixels) return 1;
+  size_t bands=min((size_t)numThreads,(size_t)img.width*img.height/min_band_pixels);
+  return max((int)bands,1);
+};
+
+//returns the first row of band n of an image of height rows split into numBands bands
+static inline png_uint_32 bandStart(png_uint_32 height, int n, int numBands)
+{
+  return (png_uint_32)((unsigned long long)height*n/numBands);
+};
+
+static void gatherColorsN(void* bands, int n)
+{
+  color_band& band=(*(vector<color_band>*)bands)[n];
+  Stopwatch stopwatch(band.timed ? &band.time : NULL);
+  try
+  {
+    ColorCollector collector(band.colors);
+    for (png_uint_32 y=band.first; y<band.last; ++y)
+    {
+      png_const_bytep pixel=&band.pixels->pixels[(size_t)y*band.pixels->width*4];
+      for (unsigned i=0; i<band.pixels->width; ++i, pixel+=4)
+        collector.add(pixelQuad(pixel,checkTransparent<true>(pixel)));
+    };
+    collector.finish();
+  }
+  catch(bad_alloc&)
+  {
+    band.outOfMemory=true;
+  };
+};
+
+//Like gatherColors() for an image whose pixels are in memory, split into numBands
+//bands that are gathered in parallel into their own color tables. Merging the
+//tables gives exactly the same result as gathering all rows at once.
+//If img.source has stats, the CPU time of the threads is added to its histogram.
+static void gatherColorsInBands(png_data& img, int numBands)
+{
+  png2ico_stats* stats=img.source->stats;
+  vector<color_band>& bands=threadScratch().colorBands;
+  bands.resize(numBands);
+  for (int n=0; n<numBands; ++n)
+  {
+    bands[n].pixels=img.pixels.get();
+    bands[n].first=bandStart(img.height,n,numBands);
+    bands[n].last=bandStart(img.height,n+1,numBands);
+    bands[n].colors.clear();
+    bands[n].outOfMemory=false;
+    bands[n].timed=(stats!=NULL);
+    bands[n].time=png2ico_time();
+  };
+  
+  parallelFor(numBands,numBands,gatherColorsN,&bands);
+  
+  ColorCollector collector(img.colors);
+  for (int n=0; n<numBands; ++n)
+  {
+    if (bands[n].outOfMemory) throw bad_alloc();
+    if (stats!=NULL) stats->histogram.cpu+=bands[n].time.cpu;
+    const color_table& colors=bands[n].colors;
+    for (unsigned c=0; c<colors.size(); ++c) collector.add(colors.quad[c],colors.count[c]);
+  };
+  collector.finish();
+};
+
+//Reads the size and bit depth of the size bytes of PNG file at png from its IHDR
+//chunk without decoding anything. col_bits is the bit depth stored for the PNG
+//file in the icon directory: the bits of all channels, but at most 32, because
+//icon directories know no deeper images. PNG files with 16 bit channels are
+//stored as 32 bit images as far as the directory is concerned.
+//Returns false if png is not a PNG file that starts with a valid IHDR chunk.
+static bool readIHDR(png_const_bytep png, size_t size, png_uint_32& width, png_uint_32& height, int& col_bits)
+{
+  if (size<33 || png_sig_cmp(png,0,8)!=0) return false;
+  if (png_get_uint_32(png+8)!=13 || memcmp(png+12,"IHDR",4)!=0) return false;
+  
+  width=png_get_uint_32(png+16);
+  height=png_get_uint_32(png+20);
+  int bit_depth=png[24];
+  int color_type=png[25];
+  int channels=1;
+  if (color_type==PNG_COLOR_TYPE_RGB) channels=3;
+  else if (color_type==PNG_COLOR_TYPE_GRAY_ALPHA) channels=2;
+  else if (color_type==PNG_COLOR_TYPE_RGB_ALPHA) channels=4;
+  col_bits=min(bit_depth*channels,32);
+  return true;
+};
+
+//reads the size and bit depth of the PNG file of img with readIHDR()
+static bool readPNGHeader(png_data& img)
+{
+  return readIHDR((png_const_bytep)img.source->png,img.source->png_size,img.width,img.height,img.col_bits);
+};
+
+//the Lanczos filter with 3 lobes
+static double lanczos3(double x)
+{
+  x=fabs(x);
+  if (x<1e-9) return 1.0;
+  if (x>=3.0) return 0.0;
+  const double pi=3.14159265358979323846;
+  return 3.0*sin(pi*x)*sin(pi*x/3.0)/(pi*pi*x*x);
+};
+
+namespace {
+
+//The weights with which the pixels of a line contribute to the pixels of the scaled
+//line. Pixel i of the scaled line is the sum of weight[i*taps+t]*source[first[i]+t]
+//for t<count[i]. The weights of each pixel are fixed point numbers with 
+//resample_bits fractional bits that add up to exactly 1.
+struct resample_weights
+{
+  int taps;
+  vector<int> first;
+  vector<int> count;
+  vector<int> weight;
+};
+
+};
+
+//Computes the weights for scaling a line of srcSize pixels to dstSize pixels with a
+//Lanczos filter. Pixels beyond the ends of the line count as the pixels at the ends.
+static void resampleWeights(int srcSize, int dstSize, resample_weights& w)
+{
+  double scale=(double)srcSize/dstSize;
+  double stretch=max(scale,1.0); //when shrinking, the filter must cover all source pixels
+  double support=3.0*stretch;
+  w.taps=min((int)(2.0*support)+3,srcSize);
+  w.first.resize(dstSize);
+  w.count.resize(dstSize);
+  w.weight.assign((size_t)dstSize*w.taps,0);
+  
+  vector<double> f(w.taps);
+  for (int i=0; i<dstSize; ++i)
+  {
+    double center=(i+0.5)*scale; //pixel j of the source covers [j,j+1)
+    int left=(int)floor(center-support);
+    int right=(int)ceil(center+support);
+    int first=max(left,0);
+    int count=min(right,srcSize-1)-first+1;
+    
+    fill(f.begin(),f.end(),0.0);
+    double sum=0;
+    for (int j=left; j<=right; ++j)
+    {
+      double weight=lanczos3((j+0.5-center)/stretch);
+      f[min(max(j,0),srcSize-1)-first]+=weight;
+      sum+=weight;
+    };
+    
+    //round to fixed point and give the rounding error to the largest weight
+    int* weight=&w.weight[(size_t)i*w.taps];
+    int total=0;
+    int largest=0;
+    for (int t=0; t<count; ++t)
+    {
+      weight[t]=(int)floor(f[t]/sum*(1<<resample_bits)+0.5);
+      total+=weight[t];
+      if (weight[t]>weight[largest]) largest=t;
+    };
+    weight[largest]+=(1<<resample_bits)-total;
+    w.first[i]=first;
+    w.count[i]=count;
+  };
+};
+
+namespace {
+
+//the state of scaleImage() shared by the threads that scale bands of an image
+struct scale_job
+{
+  const rgba_image* src;
+  rgba_image* dst;
+  resample_weights wx, wy;
+  vector<int> tmp; //the horizontally scaled rows of src
+  int numBands;
+  vector<png2ico_time> time; //time spent on each band, if measured
+};
+
+};
+
+//First pass of scaleImage(): scales band n of the rows of job->src horizontally
+//into job->tmp. The 4 channels of tmp are red*alpha, green*alpha, blue*alpha and 
+//255*alpha, i.e. all in the range 0..255*255 (but the negative lobes of the filter
+//can leave that range a bit).
+static void scaleRowsN(void* scale, int n)
+{
+  scale_job& job=*(scale_job*)scale;
+  Stopwatch stopwatch(job.time.empty() ? NULL : &job.time[n]);
+  const rgba_image& src=*job.src;
+  const resample_weights& wx=job.wx;
+  png_uint_32 width=job.dst->width;
+  const int half=1<<(resample_bits-1);
+  png_uint_32 last=bandStart(src.height,n+1,job.numBands);
+  for (png_uint_32 y=bandStart(src.height,n,job.numBands); y<last; ++y)
+  {
+    png_const_bytep row=&src.pixels[(size_t)y*src.width*4];
+    int* out=&job.tmp[(size_t)y*width*4];
+    for (png_uint_32 x=0; x<width; ++x, out+=4)
+    {
+      const int* weight=&wx.weight[(size_t)x*wx.taps];
+      png_const_bytep pixel=row+4*wx.first[x];
+      int acc[4]={0,0,0,0};
+      for (int t=0; t<wx.count[x]; ++t, pixel+=4)
+      {
+        int wa=weight[t]*pixel[3];
+        acc[0]+=wa*pixel[0];
+        acc[1]+=wa*pixel[1];
+        acc[2]+=wa*pixel[2];
+        acc[3]+=wa*255;
+      };
+      for (int c=0; c<4; ++c) out[c]=(acc[c]+half)>>resample_bits;
+    };
+  };
+};
+
+//Second pass of scaleImage(): scales the columns of job->tmp into band n of the
+//rows of job->dst. Whole rows of tmp are accumulated at once, so that the innermost
+//loop runs over consecutive memory.
+static void scaleColumnsN(void* scale, int n)
+{
+  scale_job& job=*(scale_job*)scale;
+  Stopwatch stopwatch(job.time.empty() ? NULL : &job.time[n]);
+  rgba_image& dst=*job.dst;
+  const resample_weights& wy=job.wy;
+  png_uint_32 width=dst.width;
+  const int half=1<<(resample_bits-1);
+  vector<int> acc(width*4);
+  png_uint_32 last=bandStart(dst.height,n+1,job.numBands);
+  for (png_uint_32 y=bandStart(dst.height,n,job.numBands); y<last; ++y)
+  {
+    fill(acc.begin(),acc.end(),0);
+    const int* weight=&wy.weight[(size_t)y*wy.taps];
+    for (int t=0; t<wy.count[y]; ++t)
+    {
+      const int* in=&job.tmp[(size_t)(wy.first[y]+t)*width*4];
+      int wt=weight[t];
+      for (png_uint_32 i=0; i<width*4; ++i) acc[i]+=wt*in[i];
+    };
+    
+    png_bytep out=&dst.pixels[(size_t)y*width*4];
+    for (png_uint_32 x=0; x<width; ++x, out+=4)
+    {
+      int alpha=(acc[4*x+3]+half)>>resample_bits;
+      if (alpha<=0) 
+      {
+        out[0]=out[1]=out[2]=out[3]=0;
+        continue;
+      };
+      
+      for (int c=0; c<3; ++c)
+      {
+        int color=(acc[4*x+c]+half)>>resample_bits;
+        color=(color*255+alpha/2)/alpha;
+        out[c]=min(max(color,0),255);
+      };
+      out[3]=min((alpha+127)/255,255);
+    };
+  };
+};
+
+//Scales src to width x height pixels with a separable Lanczos filter and stores the
+//result in dst. Colors are premultiplied with alpha while filtering so that the
+//(arbitrary) colors of transparent pixels do not bleed into their neighbours. The
+//filter uses integer arithmetic only, so the result is the same on all platforms.
+//Each pass is split into bands of rows that up to numThreads threads scale in
+//parallel; every output row is computed the same way regardless of the bands.
+//If stats is not NULL, the CPU time of the threads is added to it.
+static void scaleImage(const rgba_image& src, png_uint_32 width, png_uint_32 height, rgba_image& dst, 
+                       int numThreads, png2ico_time* stats)
+{
+  scale_job job;
+  job.src=&src;
+  job.dst=&dst;
+  resampleWeights(src.width,width,job.wx);
+  resampleWeights(src.height,height,job.wy);
+  job.tmp.resize((size_t)src.height*width*4);
+  dst.width=width;
+  dst.height=height;
+  dst.pixels.resize((size_t)width*height*4);
+  
+  size_t work=max((size_t)src.height*width,(size_t)width*height)/min_band_pixels;
+  job.numBands=max((int)min(min((size_t)numThreads,work),(size_t)min(src.height,height)),1);
+  if (job.numBands>1 && stats!=NULL) job.time.resize(job.numBands);
+  
+  parallelFor(job.numBands,job.numBands,scaleRowsN,&job);
+  parallelFor(job.numBands,job.numBands,scaleColumnsN,&job);
+  
+  for (unsigned n=0; n<job.time.size(); ++n) stats->cpu+=job.time[n].cpu;
+};
+
+//libpng write function that appends to the vector<png_byte> passed to png_set_write_fn()
+void writeToVector(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+  vector<png_byte>* out=(vector<png_byte>*)png_get_io_ptr(png_ptr);
+  bool ok=true;
+  try
+  {
+    out->insert(out->end(),data,data+length);
+  }
+  catch(bad_alloc&)
+  {
+    ok=false;
+  };
+  if (!ok) png_error(png_ptr,"Out of memory"); //not inside the catch block, because png_error() does not return
+};
+
+//Encodes image as 8 bit RGBA PNG file into out. Returns false and sets error if
+//libpng fails.
+//NOTE: This function must not create any C++ objects because the setjmp()/longjmp() 
+//error handling would skip their destructors.
+static bool encodePNG(const rgba_image& image, vector<png_byte>& out, string& error)
+{
+  png_structp png_ptr=png_create_write_struct
+                        (PNG_LIBPNG_VER_STRING, &error, storePNGError, ignorePNGWarning);
+  if (!png_ptr)
+  {
+    error="png_create_write_struct error";
+    return false;
+  };
+  
+  png_infop info_ptr=png_create_info_struct(png_ptr);
+  if (!info_ptr)
+  {
+    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    error="png_create_info_struct error";
+    return false;
+  };
+  
+  if (setjmp(png_jmpbuf(png_ptr)))
+  {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return false;
+  };
+  
+  png_set_write_fn(png_ptr, &out, writeToVector, NULL);
+  png_set_IHDR(png_ptr, info_ptr, image.width, image.height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  for (png_uint_32 y=0; y<image.height; ++y)
+    png_write_row(png_ptr, (png_bytep)&image.pixels[(size_t)y*image.width*4]);
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  return true;
+};
+
+//A PNG file that is scaled to one or more sizes. It is decoded only once for all of
+//them.
+struct master_image
+{
+  const png2ico_image* image; //the first image that is scaled from the PNG file
+  shared_ptr<rgba_image> pixels;
+  int status; //PNG2ICO_OK or the reason why the PNG file could not be decoded
+  string error;
+  master_image():image(NULL),status(PNG2ICO_OK){};
+};
+
+//Decodes the PNG file of image completely into pixels as 8 bit RGBA. Returns false
+//and sets error to libpng's message if this fails.
+static bool decodeRGBA(const png2ico_image& image, rgba_image& pixels, string& error)
+{
+  png_reader reader;
+  bool ok=openPNG(reader,image.png,image.png_size,READ_RGBA);
+  if (ok)
+  {
+    pixels.width=reader.width;
+    pixels.height=reader.height;
+    pixels.pixels.resize(reader.rowbytes*reader.height);
+    for (png_uint_32 y=0; ok && y<reader.height; ++y)
+    {
+      png_bytep buf=&pixels.pixels[reader.rowbytes*y];
+      png_const_bytep row=readRow(reader,buf);
+      if (row==NULL) ok=false;
+      else if (row!=buf) memcpy(buf,row,reader.rowbytes);
+    };
+  };
+  if (!ok) error=reader.error;
+  return ok;
+};
+
+//Decodes the PNG file of master.image into master.pixels. If this fails, 
+//master.status and master.error are set.
+static void decodeMaster(master_image& master)
+{
+  const png2ico_image& image=*master.image;
+  Stopwatch stopwatch(image.stats!=NULL ? &image.stats->decode : NULL);
+  if (image.png_size<8 || png_sig_cmp((png_const_bytep)image.png,0,8))
+  {
+    master.status=PNG2ICO_NOT_PNG;
+    master.error=formatMessage("%s: Not a PNG file\n",image.name);
+    return;
+  };
+  
+  try
+  {
+    master.pixels.reset(new rgba_image);
+    string pngError;
+    if (!decodeRGBA(image,*master.pixels,pngError))
+    {
+      master.pixels.reset();
+      master.status=PNG2ICO_PNG_ERROR;
+      master.error=formatMessage("%s: PNG error: %s\n",image.name,pngError.c_str());
+    };
+  }
+  catch(bad_alloc&)
+  {
+    master.pixels.reset();
+    master.status=PNG2ICO_OUT_OF_MEMORY;
+    master.error=formatMessage("%s: Out of memory\n",image.name);
+  };
+};
+
+static void decodeMasterN(void* masters, int n)
+{
+  decodeMaster((*(vector<master_image>*)masters)[n]);
+};
+
+//Scales the master of img to img.source->size and stores the result in img.pixels
+//(and img.resource for PNG2ICO_PNG). If the master already has the requested size, its
+//pixels are used directly and PNG files are stored unchanged.
+//Scaling uses up to numThreads threads.
+//Returns false and sets error if the scaled image can not be encoded as PNG file.
+static bool scaleMaster(png_data& img, const master_image& master, int numThreads, string& error)
+{
+  const rgba_image& src=*master.pixels;
+  png_uint_32 size=img.source->size;
+  png_uint_32 width=size;
+  png_uint_32 height=size;
+  //keep the aspect ratio
+  if (src.width>src.height) height=max((png_uint_32)1,(png_uint_32)((double)src.height*size/src.width+0.5));
+  if (src.height>src.width) width=max((png_uint_32)1,(png_uint_32)((double)src.width*size/src.height+0.5));
+  
+  img.width=width;
+  img.height=height;
+  if (width==src.width && height==src.height)
+  {
+    if (img.format==PNG2ICO_PNG) //copy the original PNG file
+    {
+      readPNGHeader(img); //for its bit depth
+      return true;
+    };
+    img.pixels=master.pixels;
+    return true;
+  };
+  
+  img.pixels.reset(new rgba_image);
+  png2ico_stats* stats=img.source->stats;
+  scaleImage(src,width,height,*img.pixels,numThreads,stats!=NULL ? &stats->decode : NULL);
+  if (img.format!=PNG2ICO_PNG) return true;
+  
+  string pngError;
+  bool ok=encodePNG(*img.pixels,img.resource,pngError);
+  img.pixels.reset();
+  if (!ok) error=formatMessage("%s: PNG error: %s\n",img.source->name,pngError.c_str());
+  return ok;
+};
+
+//Decodes the PNG file of job.image (or scales job.master) and gathers its colors.
+//Images that are not stored as PNG2ICO_PALETTE and not scaled only have their
+//header read. Returns true if the colors have been gathered. If this fails, 
+//job.status and job.error are set.
+bool loadColors(image_job& job)
+{
+  const png2ico_image& image=*job.image;
+  png_data& data=job.data;
+  if (!data.resource.empty()) return false; //taken from the cache by lookupCache()
+  
+  if (image.png_size<8 || png_sig_cmp((png_const_bytep)image.png,0,8))
+  {
+    job.status=PNG2ICO_NOT_PNG;
+    job.error=formatMessage("%s: Not a PNG file\n",image.name);
+    return false;
+  };
+  
+  try
+  {
+    png_reader reader;
+    if (job.master!=NULL)
+    {
+      if (job.master->status!=PNG2ICO_OK)
+      {
+        job.status=job.master->status;
+        job.error=job.master->error;
+        return false;
+      };
+      
+      Stopwatch stopwatch(image.stats!=NULL ? &image.stats->decode : NULL);
+      if (!scaleMaster(data,*job.master,job.numThreads,job.error))
+      {
+        job.status=PNG2ICO_PNG_ERROR;
+        return false;
+      };
+      stopwatch.stop();
+      if (data.pixels) openPixels(reader,*data.pixels,READ_RGBA);
+    }
+    else if (data.format==PNG2ICO_PNG) 
+    {
+      if (!readPNGHeader(data))
+      {
+        job.status=PNG2ICO_PNG_ERROR;
+        job.error=formatMessage("%s: PNG error: %s\n",image.name,"Not a PNG file or IHDR chunk missing");
+        return false;
+      };
+    }
+    else if (!openImage(reader,data,READ_NATIVE))
+    {
+      job.status=PNG2ICO_PNG_ERROR;
+      job.error=formatMessage("%s: PNG error: %s\n",image.name,reader.error.c_str());
+      return false;
+    }
+    else
+    {
+      data.width=reader.width;
+      data.height=reader.height;
+    };
+    
+    //the size of an icon image is stored in a byte, with 0 meaning 256
+    if (data.width<1 || data.width>256 || data.height<1 || data.height>256)
+    {
+      job.status=PNG2ICO_UNSUPPORTED;
+      job.error=formatMessage("%s: Width and height must be <=256.\n",image.name);
+      return false;
+    };
+    
+    //images in the other formats are decoded (or copied) straight into the icon by serializeIcon()
+    if (data.format!=PNG2ICO_PALETTE) return false;
+    
+    if ((reader.color_type & PNG_COLOR_MASK_COLOR)==0)
+    {
+      job.status=PNG2ICO_UNSUPPORTED;
+      job.error=formatMessage("%s: Grayscale image not supported\n",image.name);
+      return false;
+    };
+    
+    data.hasAlpha=((reader.color_type & PNG_COLOR_MASK_ALPHA)!=0);
+    data.indexed=(reader.color_type==PNG_COLOR_TYPE_PALETTE);
+    if (data.indexed) readPalette(data,reader);
+    
+    png2ico_time pass;
+    png2ico_time decodeBefore=(image.stats!=NULL ? image.stats->decode : png2ico_time());
+    Stopwatch stopwatch(image.stats!=NULL ? &pass : NULL);
+    int bands=numBands(data,job.numThreads);
+    if (bands>1) 
+      gatherColorsInBands(data,bands);
+    else if (!gatherColors(data,reader))
+    {
+      job.status=PNG2ICO_PNG_ERROR;
+      job.error=formatMessage("%s: PNG error: %s\n",image.name,reader.error.c_str());
+      return false;
+    };
+    stopwatch.stop();
+    if (image.stats!=NULL)
+    {
+      addPassTime(image.stats->histogram,pass,decodeBefore,image.stats->decode);
+      image.stats->unique_colors=data.colors.size();
+    };
+    return true;
+  }
+  catch(bad_alloc&)
+  {
+    job.status=PNG2ICO_OUT_OF_MEMORY;
+    job.error=formatMessage("%s: Out of memory\n",image.name);
+    return false;
+  };
+};
+
+//loadColors() followed by convertToIndexed(). Images with a shared palette are
+//converted together by convertSharedPalettes() instead.
+void loadImage(image_job& job)
+{
+  if (!loadColors(job) || job.image->shared_palette) return;
+  try
+  {
+    job.data.tooManyColors=convertToIndexed(job.data);
+  }
+  catch(bad_alloc&)
+  {
+    job.status=PNG2ICO_OUT_OF_MEMORY;
+    job.error=formatMessage("%s: Out of memory\n",job.image->name);
+  };
+};
+
+//returns true if job is an image that was loaded successfully and is to share its
+//palette with other images
+static bool sharesPalette(const image_job& job)
+{
+  return job.status==PNG2ICO_OK && job.image->shared_palette && job.data.format==PNG2ICO_PALETTE;
+};
+
+//Chooses one palette for each group of images that share their palette and have
+//the same colors, refine and quantizer settings. The colors of all images of a
+//group are merged and quantized only once. Every image then maps its colors to
+//the palette through the merged table, so that a color gets the same palette entry
+//in all images.
+static void convertSharedPalettes(vector<image_job>& jobs)
+{
+  vector<bool>& done=threadScratch().paletteDone;
+  done.assign(jobs.size(),false);
+  for (unsigned n=0; n<jobs.size(); ++n)
+  {
+    if (done[n] || !sharesPalette(jobs[n])) continue;
+    
+    const png_data& first=jobs[n].data;
+    vector<png_data*> group;
+    for (unsigned m=n; m<jobs.size(); ++m)
+    {
+      const png_data& img=jobs[m].data;
+      if (!done[m] && sharesPalette(jobs[m]) && img.requested_colors==first.requested_colors &&
+          img.refine_iterations==first.refine_iterations && img.quantizer==first.quantizer)
+      {
+        group.push_back(&jobs[m].data);
+        done[m]=true;
+      };
+    };
+    
+    //a single image keeps the order of its PNG palette if it has few colors
+    if (group.size()==1)
+    {
+      jobs[n].data.tooManyColors=convertToIndexed(jobs[n].data);
+      continue;
+    };
+    
+    png_data shared;
+    shared.source=first.source;
+    shared.requested_colors=first.requested_colors;
+    shared.col_bits=first.col_bits;
+    shared.refine_iterations=first.refine_iterations;
+    shared.quantizer=first.quantizer;
+    ColorCollector collector(shared.colors);
+    for (unsigned g=0; g<group.size(); ++g)
+    {
+      const color_table& colors=group[g]->colors;
+      for (unsigned c=0; c<colors.size(); ++c) collector.add(colors.quad[c],colors.count[c]);
+    };
+    collector.finish();
+    
+    //the warning is only issued once for the whole group
+    jobs[n].data.tooManyColors=convertToIndexed(shared);
+    
+    for (unsigned g=0; g<group.size(); ++g)
+    {
+      png_data& img=*group[g];
+      memcpy(img.palette,shared.palette,sizeof(img.palette));
+      img.num_palette=shared.num_palette;
+      for (unsigned c=0; c<img.colors.size(); ++c)
+        img.colors.palEntry[c]=shared.colors.palEntry[shared.colors.find(img.colors.quad[c])];
+    };
+  };
+};
+
+namespace {
+
+//Maps the pixel colors of an image to the palette entries chosen for them in
+//colors.palEntry. Icons mostly consist of areas of a single color, so the entry
+//of the previous pixel is reused for runs of equal pixels, and colors that recur
+//after an interruption are usually found in a small direct-mapped cache. Only the
+//remaining colors need the binary search in colors.
+class PaletteMapper
+{
+    const color_table& colors;
+    unsigned int lastQuad;
+    int lastEntry;
+    unsigned int cacheQuad[1<<palette_cache_bits];
+    png_byte cacheEntry[1<<palette_cache_bits];
+    
+  public:
+    PaletteMapper(const color_table& table):colors(table)
+    {
+      //every slot starts out with a valid pair, so that no slot needs to be marked empty
+      lastQuad=colors.quad[0];
+      lastEntry=colors.palEntry[0];
+      for (int i=0; i<(1<<palette_cache_bits); ++i)
+      {
+        cacheQuad[i]=lastQuad;
+        cacheEntry[i]=lastEntry;
+      };
+    };
+    
+    //returns the palette entry of quad, which must be contained in colors
+    int map(unsigned int quad)
+    {
+      if (quad==lastQuad) return lastEntry;
+      lastQuad=quad;
+      unsigned int slot=(quad*2654435761u)>>(32-palette_cache_bits);
+      if (cacheQuad[slot]!=quad)
+      {
+        cacheQuad[slot]=quad;
+        cacheEntry[slot]=colors.palEntry[colors.find(quad)];
+      };
+      lastEntry=cacheEntry[slot];
+      return lastEntry;
+    };
+};
+
+};
+
+//Second pass over the image: decodes img again and stores its XOR mask (the packed
+//palette entries) at xorMask and its AND mask at andMask. Both masks are stored
+//bottom-up as in the icon file. A row that is equal to the row above it is not 
+//converted again but its masks are copied.
+//Only the rows [firstRow,lastRow) are stored. firstRow may only be >0 for images 
+//whose pixels are in memory.
+//bytesPerPixel is 4 for RGBA, 3 for RGB and 1 for palette based images.
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+template<int bytesPerPixel> 
+static int writeImageMasks(const png_data& img, png_bytep xorMask, png_bytep andMask, string& error,
+                           png_uint_32 firstRow, png_uint_32 lastRow)
+{
+  const bool hasAlpha=(bytesPerPixel==4);
+  const row_kernels& kernels=rowKernels();
+  int andLineLen=andMaskLineLen(img);
+  int xorLineLen=xorMaskLineLen(img);
+  
+  //the palette entry and transparency of each index of a palette based image
+  png_byte indexEntry[256];
+  png_byte indexTrans[256];
+  if (bytesPerPixel==1)
+  {
+    for (int i=0; i<256; ++i)
+    {
+      unsigned int quad=img.indexQuad[i];
+      unsigned c=img.colors.find(quad);
+      bool used=(c<img.colors.size() && img.colors.quad[c]==quad);
+      indexEntry[i]=(used ? img.colors.palEntry[c] : 0);
+      indexTrans[i]=(quad==0);
+    };
+  };
+  
+  try
+  {
+    png_reader reader;
+    bool ok=openImage(reader,img,READ_NATIVE);
+    reader.nextRow=firstRow;
+    //rows are decoded alternately into the 2 halves of buf, so that the previous
+    //row is still available for comparison
+    scratch_buffers& scratch=threadScratch();
+    vector<png_byte>& buf=scratch.rows;
+    vector<png_byte>& index=scratch.index;
+    vector<png_byte>& trans=scratch.trans;
+    buf.resize(2*reader.rowbytes);
+    index.resize(img.width);
+    trans.resize(img.width);
+    PaletteMapper mapper(img.colors);
+    png_const_bytep prevRow=NULL;
+    for (png_uint_32 y=firstRow; ok && y<lastRow; ++y)
+    {
+      png_const_bytep row=readRow(reader,&buf[(y&1)*reader.rowbytes]);
+      if (row==NULL) { ok=false; break; };
+      
+      png_bytep andLine=andMask+(size_t)andLineLen*(img.height-1-y);
+      png_bytep xorLine=xorMask+(size_t)xorLineLen*(img.height-1-y);
+      bool sameAsAbove=(prevRow!=NULL && memcmp(row,prevRow,reader.rowbytes)==0);
+      prevRow=row;
+      if (sameAsAbove)
+      {
+        memcpy(andLine,andLine+andLineLen,andLineLen);
+        memcpy(xorLine,xorLine+xorLineLen,xorLineLen);
+        continue;
+      };
+      
+      int length=0;
+      if (bytesPerPixel==1)
+      {
+        for (unsigned i=0; i<img.width; ++i)
+        {
+          index[i]=indexEntry[row[i]];
+          trans[i]=indexTrans[row[i]];
+        };
+        length=kernels.pack(&trans[0],img.width,1,andLine);
+      }
+      else 
+      {
+        if (hasAlpha) length=kernels.alphaMask(row,img.width,andLine);
+        
+        png_const_bytep pixel=row;
+        for (unsigned i=0; i<img.width; ++i)
+        {
+          index[i]=mapper.map(pixelQuad(pixel,checkTransparent<hasAlpha>(pixel)));
+          pixel+=bytesPerPixel;
+        };
+      };
+      memset(andLine+length,0,andLineLen-length);
+      
+      length=kernels.pack(&index[0],img.width,img.col_bits,xorLine);
+      memset(xorLine+length,0,xorLineLen-length);
+    };
+    
+    if (!ok)
+    {
+      error=formatMessage("%s: PNG error: %s\n",img.source->name,reader.error.c_str());
+      return PNG2ICO_PNG_ERROR;
+    };
+  }
+  catch(bad_alloc&)
+  {
+    error=formatMessage("%s: Out of memory\n",img.source->name);
+    return PNG2ICO_OUT_OF_MEMORY;
+  };
+  
+  return PNG2ICO_OK;
+};
+
+//Decodes img as 8 bit BGRA straight into xorMask and stores the corresponding AND
+//mask at andMask, both bottom-up as in the icon file.
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+static int writeBGRAMasks(const png_data& img, png_bytep xorMask, png_bytep andMask, string& error)
+{
+  const row_kernels& kernels=rowKernels();
+  int andLineLen=andMaskLineLen(img);
+  int xorLineLen=xorMaskLineLen(img);
+  
+  try
+  {
+    png_reader reader;
+    bool ok=openImage(reader,img,READ_BGRA);
+    for (png_uint_32 y=0; ok && y<img.height; ++y)
+    {
+      png_bytep xorLine=xorMask+(size_t)xorLineLen*(img.height-1-y);
+      png_const_bytep row=readRow(reader,xorLine);
+      if (row==NULL) { ok=false; break; };
+      if (row!=xorLine) memcpy(xorLine,row,xorLineLen);
+      
+      png_bytep andLine=andMask+(size_t)andLineLen*(img.height-1-y);
+      int length=kernels.alphaMask(xorLine,img.width,andLine);
+      memset(andLine+length,0,andLineLen-length);
+    };
+    
+    if (!ok)
+    {
+      error=formatMessage("%s: PNG error: %s\n",img.source->name,reader.error.c_str());
+      return PNG2ICO_PNG_ERROR;
+    };
+  }
+  catch(bad_alloc&)
+  {
+    error=formatMessage("%s: Out of memory\n",img.source->name);
+    return PNG2ICO_OUT_OF_MEMORY;
+  };
+  
+  return PNG2ICO_OK;
+};
+
+//returns the number of bytes of the image resource of img in the icon file
+static size_t imageResourceSize(const png_data& img)
+{
+  if (!img.resource.empty()) return img.resource.size();
+  if (img.format==PNG2ICO_PNG) return img.source->png_size;
+  return 40+img.requested_colors*4+(size_t)(andMaskLineLen(img)+xorMaskLineLen(img))*img.height;
+};
+
+//returns the size of the icon file made of the images in pngdata
+size_t iconSize(const vector<png_data>& pngdata)
+{
+  size_t size=6+pngdata.size()*16;
+  for (unsigned n=0; n<pngdata.size(); ++n) size+=imageResourceSize(pngdata[n]);
+  return size;
+};
+
+#ifndef _WIN32
+//Creates a new file with a unique temporary name next to fileName, open for
+//reading and writing, and stores its name in tempName. Returns the file 
+//descriptor or -1 if the file could not be created.
+static int createTempFile(const string& fileName, string& tempName)
+{
+  static atomic<unsigned int> tempCounter(0);
+  int fd;
+  do
+  {
+    char suffix[64];
+    snprintf(suffix,sizeof(suffix),".%ld.%u.tmp",(long)getpid(),tempCounter++);
+    tempName=fileName+suffix;
+    fd=open(tempName.c_str(),O_RDWR|O_CREAT|O_EXCL,0666);
+  } while(fd<0 && errno==EEXIST);
+  return fd;
+};
+
+//writes the size bytes at data to fd. Returns false if this fails.
+static bool writeAll(int fd, const void* data, size_t size)
+{
+  png_const_bytep p=(png_const_bytep)data;
+  while(size>0)
+  {
+    ssize_t n=write(fd,p,size);
+    if (n<0 && errno==EINTR) continue;
+    if (n<=0) return false;
+    p+=n;
+    size-=n;
+  };
+  return true;
+};
+
+namespace {
+
+//an open file that an icon is written to
+struct output_file
+{
+  string target;   //the file that is written, with symlinks resolved
+  string tempName; //the temporary file that replaces target, empty if target is written directly
+  int fd;
+};
+
+};
+
+//Opens fileName for writing an icon. A regular file is replaced atomically by
+//a temporary file created next to it, which gets the mode and owner of the file
+//it replaces. Symlinks are resolved first, so that the link is kept and its
+//target is replaced. Anything else, e.g. /dev/stdout, a FIFO or a dangling
+//symlink, is opened and written directly, because renaming over it would
+//replace it instead of writing to it.
+//Returns false and sets error if the file cannot be opened.
+static bool openOutputFile(const char* fileName, output_file& out, string& error)
+{
+  out.target=fileName;
+  out.tempName.clear();
+  
+  struct stat st;
+  bool exists=(lstat(fileName,&st)==0);
+  if (exists && S_ISLNK(st.st_mode))
+  {
+    char* resolved=NULL;
+    if (stat(fileName,&st)==0 && S_ISREG(st.st_mode)) resolved=realpath(fileName,NULL);
+    if (resolved!=NULL)
+    {
+      out.target=resolved;
+      free(resolved);
+    }
+    else 
+      st.st_mode=0; //not a regular file => written through the link
+  };
+  
+  if (!exists || S_ISREG(st.st_mode))
+  {
+    out.fd=createTempFile(out.target,out.tempName); //opened for reading, too, because mmap() needs it
+    if (out.fd>=0 && exists)
+    {
+      //the owner can only be kept by root (or the owner for another of his groups);
+      //it is set before the mode because chown() clears the set-user-ID bit
+      if (fchown(out.fd,st.st_uid,st.st_gid)!=0) errno=0;
+      fchmod(out.fd,st.st_mode&07777);
+    };
+  }
+  else
+    out.fd=open(fileName,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  
+  if (out.fd<0) error=formatMessage("%s: %s\n",fileName,strerror(errno));
+  return out.fd>=0;
+};
+
+//Closes out. If ok, the temporary file (if any) is flushed to disk and renamed 
+//to the target, otherwise it is removed. Returns false if ok is false or closing
+//fails, and sets error in the latter case.
+static bool closeOutputFile(output_file& out, bool ok, string& error)
+{
+  //without the fsync() a crash shortly after the rename() could leave an empty 
+  //file behind instead of the old or the new icon
+  if (ok && !out.tempName.empty() && fsync(out.fd)!=0)
+  {
+    error=formatMessage("Write error: %s\n",strerror(errno));
+    ok=false;
+  };
+  
+  if (close(out.fd)!=0 && ok) 
+  {
+    error=formatMessage("Write error: %s\n",strerror(errno));
+    ok=false;
+  };
+  
+  if (out.tempName.empty()) return ok;
+  
+  if (ok && rename(out.tempName.c_str(),out.target.c_str())!=0)
+  {
+    error=formatMessage("%s: %s\n",out.target.c_str(),strerror(errno));
+    ok=false;
+  };
+  
+  if (!ok) unlink(out.tempName.c_str());
+  return ok;
+};
+#endif
+
+//the finalizer of MurmurHash3, which makes every bit of the result depend on every bit of h
+static inline unsigned long long mix64(unsigned long long h)
+{
+  h^=h>>33;
+  h*=0xFF51AFD7ED558CCDull;
+  h^=h>>33;
+  h*=0xC4CEB9FE1A85EC53ull;
+  h^=h>>33;
+  return h;
+};
+
+void hash128::add(const void* data, size_t size)
+{
+  png_const_bytep p=(png_const_bytep)data;
+  unsigned long long a=lo;
+  unsigned long long b=hi^size;
+  for (; size>=8; size-=8, p+=8)
+  {
+    unsigned long long word;
+    memcpy(&word,p,8);
+    a=(a^word)*0x9E3779B97F4A7C15ull;
+    a^=a>>29;
+    b=(b+word)*0xC2B2AE3D27D4EB4Full;
+    b=(b<<31)|(b>>33);
+  };
+  
+  unsigned long long tail=0;
+  memcpy(&tail,p,size);
+  lo=mix64(a^tail);
+  hi=mix64(b+tail+lo);
+};
+
+#ifndef _WIN32
+//returns the name of the file that stores the image with the given key in cache
+static string cacheFileName(const png2ico_cache& cache, const string& key)
+{
+  string name=cache.dir;
+  if (!name.empty() && name[name.size()-1]!='/') name+='/';
+  return name+key;
+};
+
+//Returns true if header (see storeInCache()) and the size of the image resource
+//following it in a cache file fit img, whose format and number of colors are set
+//by setupImageJob(). Otherwise the file is damaged or was not written by this
+//version and must not be used.
+static bool cacheHeaderValid(const png_data& img, const png_byte* header, long long size)
+{
+  if (memcmp(header,"P2IC",4)!=0 || header[6]==0 || header[6]>32) return false;
+  if (img.format==PNG2ICO_PNG) return size>=33; //signature and IHDR chunk
+  if (header[6]!=img.col_bits) return false;
+  
+  png_data expected;
+  expected.format=img.format;
+  expected.requested_colors=img.requested_colors;
+  expected.width=(header[4]==0 ? 256 : header[4]);
+  expected.height=(header[5]==0 ? 256 : header[5]);
+  expected.col_bits=header[6];
+  return size==(long long)imageResourceSize(expected);
+};
+
+//Returns true if the image resource read from a cache file starts like the ones
+//written by serializeIcon(): a BITMAPINFOHEADER of the size in header or a PNG
+//file of that size.
+static bool cacheResourceValid(const png_data& img, const png_byte* header, const vector<png_byte>& resource)
+{
+  png_const_bytep res=&resource[0];
+  unsigned width=(header[4]==0 ? 256 : header[4]);
+  unsigned height=(header[5]==0 ? 256 : header[5]);
+  if (img.format==PNG2ICO_PNG)
+    return png_sig_cmp(res,0,8)==0 && png_get_uint_32(res+8)==13 && memcmp(res+12,"IHDR",4)==0 &&
+           png_get_uint_32(res+16)==width && png_get_uint_32(res+20)==height;
+  return getDWord(res)==40 && getDWord(res+4)==width && getDWord(res+8)==2*height;
+};
+
+//Looks up the image of job in its cache. If it is found, the image resource is
+//stored in job.data.resource together with the size and bit depth of the image
+//and the file is marked as used. Otherwise job.data.cacheKey is set, so that 
+//serializeIcon() stores the converted image in the cache.
+//Images with a shared palette are not cached, because their palette depends on
+//the other images, and neither are PNG files that are copied unchanged.
+static void lookupCache(image_job& job)
+{
+  const png2ico_image& image=*job.image;
+  png_data& data=job.data;
+  if (image.cache==NULL || image.cache->dir==NULL || image.shared_palette) return;
+  if (image.format==PNG2ICO_PNG && image.size==0) return;
+  Stopwatch stopwatch(image.stats!=NULL ? &image.stats->decode : NULL);
+  
+  //the settings that influence the result
+  char settings[256];
+  snprintf(settings,sizeof(settings),"%d %d %d %d %d %s",cache_version,image.format,image.size,
+           image.colors,image.refine,image.quantizer!=NULL ? image.quantizer : "farthest");
+  hash128 hash;
+  hash.add(image.png,image.png_size);
+  hash.add(settings,strlen(settings));
+  char key[33];
+  snprintf(key,sizeof(key),"%016llx%016llx",hash.lo,hash.hi);
+  data.cacheKey=key;
+  
+  int fd=open(cacheFileName(*image.cache,data.cacheKey).c_str(),O_RDONLY);
+  if (fd<0) return;
+  
+  struct stat st;
+  png_byte header[cache_header_size];
+  bool ok=(fstat(fd,&st)==0 && st.st_size>cache_header_size);
+  ok=ok && read(fd,header,cache_header_size)==cache_header_size;
+  bool damaged=(ok && !cacheHeaderValid(data,header,st.st_size-cache_header_size));
+  if (ok && !damaged)
+  {
+    try
+    {
+      data.resource.resize(st.st_size-cache_header_size);
+    }
+    catch(bad_alloc&) //the image is then converted as if it was not in the cache
+    {
+      ok=false;
+    };
+    
+    size_t done=0;
+    while(ok && done<data.resource.size())
+    {
+      ssize_t n=read(fd,&data.resource[done],data.resource.size()-done);
+      if (n<0 && errno==EINTR) continue;
+      if (n<=0) ok=false; else done+=n;
+    };
+    damaged=(ok && !cacheResourceValid(data,header,data.resource));
+  };
+  
+  if (ok && !damaged)
+  {
+    futimens(fd,NULL); //the modification time is the time of the last use
+    data.width=(header[4]==0 ? 256 : header[4]);
+    data.height=(header[5]==0 ? 256 : header[5]);
+    data.col_bits=header[6];
+    data.tooManyColors=(header[7]!=0);
+    data.cacheKey.clear();
+    if (image.stats!=NULL) image.stats->cached=true;
+  }
+  else vector<png_byte>().swap(data.resource);
+  close(fd);
+  
+  //a damaged file is replaced when the converted image is stored
+  if (damaged) unlink(cacheFileName(*image.cache,data.cacheKey).c_str());
+};
+
+//Stores the image resource of img (size bytes at resource) in its cache under
+//img.cacheKey, together with the result of convertToIndexed(). The file is
+//written under a temporary name and then renamed, so that other processes never
+//see a partially written file. Errors are ignored because the cache only saves
+//time.
+static void storeInCache(const png_data& img, png_const_bytep resource, size_t size)
+{
+  string fileName=cacheFileName(*img.source->cache,img.cacheKey);
+  string tempName;
+  int fd=createTempFile(fileName,tempName);
+  if (fd<0) return;
+  
+  png_byte header[cache_header_size]={'P','2','I','C',(png_byte)img.width,(png_byte)img.height,
+                                      (png_byte)img.col_bits,(png_byte)img.tooManyColors};
+  bool ok=writeAll(fd,header,cache_header_size) && writeAll(fd,resource,size);
+  if (close(fd)!=0) ok=false;
+  if (!ok || rename(tempName.c_str(),fileName.c_str())!=0) unlink(tempName.c_str());
+};
+
+namespace {
+
+//a file of a png2ico_cache
+struct cache_file
+{
+  string name;
+  long long size;
+  struct timespec used; //modification time, i.e. time of the last use
+  bool operator<(const cache_file& other) const
+  {
+    if (used.tv_sec!=other.used.tv_sec) return used.tv_sec<other.used.tv_sec;
+    if (used.tv_nsec!=other.used.tv_nsec) return used.tv_nsec<other.used.tv_nsec;
+    return name<other.name;
+  };
+};
+
+};
+
+//Removes the least recently used files from cache until its size is at most
+//cache.max_size*cache_evict_percent/100. Only files named like cache keys are
+//counted and removed. Returns the size of the remaining files.
+static long long shrinkCache(const png2ico_cache& cache)
+{
+  DIR* dir=opendir(cache.dir);
+  if (dir==NULL) return 0;
+  
+  vector<cache_file> files;
+  long long total=0;
+  struct dirent* entry;
+  while((entry=readdir(dir))!=NULL)
+  {
+    const char* name=entry->d_name;
+    if (strlen(name)!=32 || strspn(name,"0123456789abcdef")!=32) continue;
+    
+    struct stat st;
+    if (fstatat(dirfd(dir),name,&st,0)!=0 || !S_ISREG(st.st_mode)) continue;
+    cache_file file;
+    file.name=name;
+    file.size=st.st_size;
+    file.used=st.st_mtim;
+    files.push_back(file);
+    total+=file.size;
+  };
+  closedir(dir);
+  
+  if (total<=cache.max_size) return total;
+  long long target=cache.max_size/100*cache_evict_percent;
+  sort(files.begin(),files.end());
+  for (unsigned f=0; f<files.size() && total>target; ++f)
+  {
+    unlink(cacheFileName(cache,files[f].name).c_str());
+    total-=files[f].size;
+  };
+  return total;
+};
+
+//Keeps cache within cache.max_size after added bytes have been stored in it.
+//Scanning the directory costs a system call per file, so it is only scanned the
+//first time and whenever the size known from the last scan plus the bytes this
+//process has stored since exceeds max_size. Because a full cache is shrunk
+//below max_size, this happens only after many images have been stored. Files
+//stored by other processes are noticed at the next scan. The sizes of at most
+//max_known_caches directories are remembered; a process that uses more caches
+//forgets the least recently used one, which is then scanned again if it is
+//used again.
+static void evictCache(const png2ico_cache& cache, long long added)
+{
+  if (cache.max_size<=0) return;
+  
+  static mutex mtx;
+  static vector<pair<string,long long> > sizes; //directory and estimated size of the caches used, most recently used last
+  lock_guard<mutex> lock(mtx);
+  unsigned c=0;
+  while(c<sizes.size() && sizes[c].first!=cache.dir) ++c;
+  if (c<sizes.size())
+  {
+    rotate(sizes.begin()+c,sizes.begin()+c+1,sizes.end());
+    c=sizes.size()-1;
+    sizes[c].second+=added;
+    if (sizes[c].second<=cache.max_size) return;
+  }
+  else
+  {
+    if (sizes.size()>=max_known_caches) sizes.erase(sizes.begin());
+    sizes.push_back(make_pair(string(cache.dir),0LL));
+    c=sizes.size()-1;
+  };
+  sizes[c].second=shrinkCache(cache);
+};
+#else
+static void lookupCache(image_job&)
+{
+};
+
+static void storeInCache(const png_data&, png_const_bytep, size_t)
+{
+};
+
+static void evictCache(const png2ico_cache&, long long)
+{
+};
+#endif
+
+static void lookupCacheN(void* jobs, int n)
+{
+  image_job& job=(*(vector<image_job>*)jobs)[n];
+  try
+  {
+    lookupCache(job);
+  }
+  catch(bad_alloc&)
+  {
+    job.data.cacheKey.clear();
+  };
+};
+
+static void writeImageMasksBandN(void* bands, int n)
+{
+  mask_band& band=(*(vector<mask_band>*)bands)[n];
+  Stopwatch stopwatch(band.timed ? &band.time : NULL);
+  const mask_job& job=*band.job;
+  band.status=writeImageMasks<4>(*job.img,job.xorMask,job.andMask,band.error,band.first,band.last);
+};
+
+//Stores the masks of an RGBA image whose pixels are in memory with numBands 
+//threads that each take a band of rows. The masks are exactly the same as if 
+//they were stored by a single thread.
+//If the image has stats, the CPU time of the threads is added to its write time.
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+static int writeImageMasksInBands(const mask_job& job, int numBands, string& error)
+{
+  png2ico_stats* stats=job.img->source->stats;
+  try
+  {
+    vector<mask_band>& bands=threadScratch().maskBands;
+    bands.resize(numBands);
+    for (int n=0; n<numBands; ++n)
+    {
+      bands[n].job=&job;
+      bands[n].first=bandStart(job.img->height,n,numBands);
+      bands[n].last=bandStart(job.img->height,n+1,numBands);
+      bands[n].timed=(stats!=NULL);
+      bands[n].time=png2ico_time();
+    };
+    
+    parallelFor(numBands,numBands,writeImageMasksBandN,&bands);
+    
+    for (int n=0; n<numBands; ++n)
+    {
+      if (stats!=NULL) stats->write.cpu+=bands[n].time.cpu;
+      if (bands[n].status!=PNG2ICO_OK)
+      {
+        error=bands[n].error;
+        return bands[n].status;
+      };
+    };
+  }
+  catch(bad_alloc&)
+  {
+    error=formatMessage("%s: Out of memory\n",job.img->source->name);
+    return PNG2ICO_OUT_OF_MEMORY;
+  };
+  return PNG2ICO_OK;
+};
+
+//stores the image of job at its place in the icon
+void storeImageResource(mask_job& job)
+{
+  if (!job.img->resource.empty())
+  {
+    memcpy(job.xorMask,&job.img->resource[0],job.img->resource.size());
+    job.status=PNG2ICO_OK;
+  }
+  else if (job.img->format==PNG2ICO_PNG)
+  {
+    memcpy(job.xorMask,job.img->source->png,job.img->source->png_size);
+    job.status=PNG2ICO_OK;
+  }
+  else if (job.img->format==PNG2ICO_BGRA)
+    job.status=writeBGRAMasks(*job.img,job.xorMask,job.andMask,job.error);
+  else if (job.img->indexed)
+    job.status=writeImageMasks<1>(*job.img,job.xorMask,job.andMask,job.error,0,job.img->height);
+  else if (numBands(*job.img,job.numThreads)>1) //only images in memory, which are RGBA
+    job.status=writeImageMasksInBands(job,numBands(*job.img,job.numThreads),job.error);
+  else if (job.img->hasAlpha)
+    job.status=writeImageMasks<4>(*job.img,job.xorMask,job.andMask,job.error,0,job.img->height);
+  else
+    job.status=writeImageMasks<3>(*job.img,job.xorMask,job.andMask,job.error,0,job.img->height);
+};
+
+static void writeImageMasksN(void* jobs, int n)
+{
+  mask_job& job=(*(vector<mask_job>*)jobs)[n];
+  png2ico_stats* stats=job.img->source->stats;
+  if (stats==NULL)
+  {
+    storeImageResource(job);
+    return;
+  };
+  
+  png2ico_time pass;
+  png2ico_time decodeBefore=stats->decode;
+  Stopwatch stopwatch(&pass);
+  storeImageResource(job);
+  stopwatch.stop();
+  addPassTime(stats->write,pass,decodeBefore,stats->decode);
+};
+
+//Stores the icon made of the converted images in pngdata at out, which must have
+//room for iconSize(pngdata) bytes. The images are decoded again and their masks are
+//stored directly at their place in out, up to numThreads images in parallel.
+//Afterwards the images that have a cacheKey are stored in their cache.
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+int serializeIcon(const vector<png_data>& pngdata, png_bytep out, int numThreads, string& error)
+{
+  putWord(out,0); //idReserved
+  putWord(out,1); //idType
+  putWord(out,pngdata.size()); //idCount
+  
+  int offset=6+pngdata.size()*16;
+  
+  vector<png_data>::const_iterator img;
+  for(img=pngdata.begin(); img!=pngdata.end(); ++img)
+  {
+    putByte(out,img->width); //bWidth
+    putByte(out,img->height); //bHeight
+    putByte(out,img->requested_colors&255); //bColorCount
+    putByte(out,0); //bReserved
+    bool truecolor=(img->format!=PNG2ICO_PALETTE);
+    putWord(out,truecolor ? 1 : 0); //wPlanes
+    putWord(out,truecolor ? img->col_bits : 0); //wBitCount
+    int resSize=imageResourceSize(*img);
+    putDWord(out,resSize); //dwBytesInRes
+    putDWord(out,offset); //dwImageOffset
+    offset+=resSize;
+  };
+  
+  vector<mask_job>& jobs=threadScratch().maskJobs;
+  jobs.resize(pngdata.size());
+  for(img=pngdata.begin(); img!=pngdata.end(); ++img)
+  {
+    mask_job& job=jobs[img-pngdata.begin()];
+    job.img=&*img;
+    job.resource=out;
+    job.numThreads=max(1,numThreads/(int)pngdata.size()); //threads left over from storing the images in parallel
+    if (img->format==PNG2ICO_PNG || !img->resource.empty()) //the image resource only has to be copied
+    {
+      job.xorMask=out;
+      job.andMask=NULL;
+      out+=imageResourceSize(*img);
+      continue;
+    };
+    
+    int andLineLen=andMaskLineLen(*img);
+    int xorLineLen=xorMaskLineLen(*img);
+    putDWord(out,40); //biSize
+    putDWord(out,img->width); //biWidth
+    putDWord(out,2*img->height); //biHeight (2 times because the 2 masks are counted)
+    putWord(out,1);   //biPlanes
+    putWord(out,img->col_bits);   //biBitCount
+    putDWord(out,0);  //biCompression
+    putDWord(out,(andLineLen+xorLineLen)*img->height);  //biSizeImage
+    putDWord(out,0);  //biXPelsPerMeter
+    putDWord(out,0);  //biYPelsPerMeter
+    putDWord(out,0); //biClrUsed (MUST BE 0 ACCORDING TO bmp.txt!!! I tried putting the real number here, but this breaks icons in some places)
+    putDWord(out,0);   //biClrImportant
+    for (int i=0; i<img->requested_colors; ++i)
+    {
+      putByte(out,img->palette[i].blue);
+      putByte(out,img->palette[i].green);
+      putByte(out,img->palette[i].red);
+      putByte(out,0);
+    };
+    
+    job.xorMask=out;
+    out+=(size_t)xorLineLen*img->height;
+    job.andMask=out;
+    out+=(size_t)andLineLen*img->height;
+  };
+  
+  parallelFor(jobs.size(),numThreads,writeImageMasksN,&jobs);
+  
+  for (unsigned n=0; n<jobs.size(); ++n)
+  {
+    if (jobs[n].status!=PNG2ICO_OK)
+    {
+      error=jobs[n].error;
+      return jobs[n].status;
+    };
+  };
+  
+  //failing to store an image in the cache is not an error, because the icon is complete
+  try
+  {
+    vector<const png2ico_cache*> caches; //the caches that images have been stored in
+    vector<long long> added; //bytes stored in caches[c]
+    for (unsigned n=0; n<jobs.size(); ++n)
+    {
+      const png_data& img=*jobs[n].img;
+      if (img.cacheKey.empty()) continue;
+      size_t size=imageResourceSize(img);
+      storeInCache(img,jobs[n].resource,size);
+      unsigned c=find(caches.begin(),caches.end(),img.source->cache)-caches.begin();
+      if (c==caches.size()) 
+      {
+        caches.push_back(img.source->cache);
+        added.push_back(0);
+      };
+      added[c]+=cache_header_size+size;
+    };
+    for (unsigned c=0; c<caches.size(); ++c) evictCache(*caches[c],added[c]);
+  }
+  catch(bad_alloc&)
+  {
+  };
+  
+  return PNG2ICO_OK;
+};
+
+//Writes the icon made of the images in pngdata to fileName. A regular file is
+//first written under a temporary name in the same directory and then renamed to 
+//fileName, so that fileName never contains a partially written icon (see
+//openOutputFile()). Large icons are serialized directly into a memory mapping of
+//the temporary file, smaller ones into a buffer that is written with a single write().
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+static int writeIconFile(const char* fileName, const vector<png_data>& pngdata, int numThreads, string& error)
+{
+  size_t size=iconSize(pngdata);
+  
+#ifdef _WIN32
+  vector<unsigned char> buf(size);
+  int status=serializeIcon(pngdata,&buf[0],numThreads,error);
+  if (status!=PNG2ICO_OK) return status;
+  FILE* outfile=fopen(fileName,"wb");
+  if (outfile==NULL) {error=formatMessage("%s: %s\n",fileName,strerror(errno)); return PNG2ICO_WRITE_ERROR;};
+  if (fwrite(&buf[0],size,1,outfile)!=1)
+  {
+    error=formatMessage("Write error: %s\n",strerror(errno));
+    fclose(outfile);
+    return PNG2ICO_WRITE_ERROR;
+  };
+  if (fclose(outfile)!=0) {error=formatMessage("Write error: %s\n",strerror(errno)); return PNG2ICO_WRITE_ERROR;};
+  return PNG2ICO_OK;
+#else
+  output_file out;
+  if (!openOutputFile(fileName,out,error)) return PNG2ICO_WRITE_ERROR;
+  
+  bool ok=true;
+  int status=PNG2ICO_OK;
+  if (size>=mmap_write_threshold && !out.tempName.empty())
+  {
+    //reserve the disk space first, because running out of it while writing to
+    //the mapping would kill the process with SIGBUS
+    int err=posix_fallocate(out.fd,0,size);
+    void* map=MAP_FAILED;
+    if (err==0) map=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,out.fd,0);
+    else errno=err;
+    
+    if (map==MAP_FAILED) 
+      ok=false;
+    else
+    {
+      status=serializeIcon(pngdata,(png_bytep)map,numThreads,error);
+      if (munmap(map,size)!=0) ok=false;
+    };
+  }
+  else
+  {
+    vector<unsigned char> buf(size);
+    status=serializeIcon(pngdata,&buf[0],numThreads,error);
+    if (status==PNG2ICO_OK) ok=writeAll(out.fd,&buf[0],size);
+  };
+  
+  if (!ok) error=formatMessage("Write error: %s\n",strerror(errno));
+  if (!closeOutputFile(out,ok && status==PNG2ICO_OK,error) && status==PNG2ICO_OK) 
+    status=PNG2ICO_WRITE_ERROR;
+  return status;
+#endif
+};
+
+namespace {
+
+//an image in the directory of an icon file
+struct icon_entry
+{
+  png_const_bytep dirEntry; //its ICONDIRENTRY
+  size_t offset;            //position of its image resource in the file
+  size_t size;              //number of bytes of the image resource
+  png_uint_32 width, height;
+  int col_bits;
+  bool png;                 //true if the image resource is a PNG file
+};
+
+};
+
+//Reads the directory of the icon file made of the size bytes at data into 
+//entries. The size and bit depth of each image are taken from its image resource,
+//because the ICONDIRENTRY can not express 256 colors and sizes above 256 and is
+//often filled in incorrectly. Returns false if data is not a valid icon file.
+static bool readIconDirectory(png_const_bytep data, size_t size, vector<icon_entry>& entries)
+{
+  entries.clear();
+  if (size<6 || getWord(data)!=0 || getWord(data+2)!=1) return false;
+  unsigned int count=getWord(data+4);
+  if (size<6+16*(size_t)count) return false;
+  
+  for (unsigned n=0; n<count; ++n)
+  {
+    icon_entry entry;
+    entry.dirEntry=data+6+16*n;
+    entry.size=getDWord(entry.dirEntry+8);
+    entry.offset=getDWord(entry.dirEntry+12);
+    if (entry.offset>size || entry.size>size-entry.offset) return false;
+    
+    png_const_bytep res=data+entry.offset;
+    entry.png=(entry.size>=8 && png_sig_cmp(res,0,8)==0);
+    if (entry.png)
+    {
+      if (!readIHDR(res,entry.size,entry.width,entry.height,entry.col_bits)) return false;
+    }
+    else
+    {
+      if (entry.size<40) return false;
+      entry.width=getDWord(res+4);
+      entry.height=getDWord(res+8)/2; //the height of the XOR and AND mask together
+      entry.col_bits=getWord(res+14);
+    };
+    entries.push_back(entry);
+  };
+  
+  return true;
+};
+
+namespace {
+
+//a part of an updated icon file
+struct icon_piece
+{
+  png_const_bytep data; //the bytes of the piece
+  size_t offset;        //position of data in the old icon file if fromOld
+  size_t size;
+  bool fromOld;         //true if the piece is copied from the old icon file
+};
+
+};
+
+//Plans the icon file that results from updating the old icon file (oldSize bytes
+//at old) with the images of the icon file at fresh as described for 
+//png2ico_update_file(). The new directory is stored in dir and the image resources
+//in the order they are to be written in pieces. 
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+static int planIconUpdate(png_const_bytep old, size_t oldSize, const vector<unsigned char>& fresh,
+                          vector<png_byte>& dir, vector<icon_piece>& pieces, string& error)
+{
+  vector<icon_entry> oldEntries, newEntries;
+  if (!readIconDirectory(old,oldSize,oldEntries)) 
+  {
+    error="Not an icon file\n";
+    return PNG2ICO_NOT_ICON;
+  };
+  readIconDirectory(&fresh[0],fresh.size(),newEntries);
+  
+  //the images of the new file, each with true if it is taken from the old file
+  vector<pair<const icon_entry*,bool> > entries;
+  vector<bool> used(newEntries.size(),false);
+  for (unsigned o=0; o<oldEntries.size(); ++o)
+  {
+    const icon_entry& entry=oldEntries[o];
+    unsigned n=0;
+    while(n<newEntries.size() && (used[n] || newEntries[n].width!=entry.width || 
+          newEntries[n].height!=entry.height || newEntries[n].col_bits!=entry.col_bits)) ++n;
+    if (n<newEntries.size()) 
+    {
+      used[n]=true;
+      entries.push_back(make_pair(&newEntries[n],false));
+    }
+    else entries.push_back(make_pair(&entry,true));
+  };
+  for (unsigned n=0; n<newEntries.size(); ++n)
+    if (!used[n]) entries.push_back(make_pair(&newEntries[n],false));
+  
+  if (entries.size()>(unsigned)word_max)
+  {
+    error="Too many images\n";
+    return PNG2ICO_INVALID_ARGUMENT;
+  };
+  
+  dir.resize(6+16*entries.size());
+  png_bytep out=&dir[0];
+  putWord(out,0); //idReserved
+  putWord(out,1); //idType
+  putWord(out,entries.size()); //idCount
+  
+  size_t offset=dir.size();
+  pieces.clear();
+  for (unsigned e=0; e<entries.size(); ++e)
+  {
+    const icon_entry& entry=*entries[e].first;
+    if (offset+entry.size>0xFFFFFFFFu)
+    {
+      error="Icon file too large\n";
+      return PNG2ICO_UNSUPPORTED;
+    };
+    
+    memcpy(out,entry.dirEntry,12); //everything except for dwImageOffset
+    out+=12;
+    putDWord(out,offset); //dwImageOffset
+    offset+=entry.size;
+    
+    icon_piece piece;
+    piece.fromOld=entries[e].second;
+    piece.data=(piece.fromOld ? old : &fresh[0])+entry.offset;
+    piece.offset=entry.offset;
+    piece.size=entry.size;
+    pieces.push_back(piece);
+  };
+  
+  return PNG2ICO_OK;
+};
+
+#ifndef _WIN32
+//Copies size bytes at offset of the file from, which are also mapped at data, to
+//the current position of the file to. On Linux copy_file_range() lets the kernel
+//copy them (or share the blocks on file systems that support it) without them
+//ever being read into memory.
+static bool copyFileRange(int from, size_t offset, png_const_bytep data, int to, size_t size)
+{
+#ifdef __linux__
+  loff_t pos=offset;
+  while(size>0)
+  {
+    ssize_t n=copy_file_range(from,&pos,to,NULL,size,0);
+    if (n<0 && errno==EINTR) continue;
+    if (n<=0) break; //not supported for these files, so write the rest from the mapping
+    data+=n;
+    size-=n;
+  };
+#else
+  (void)from;
+  (void)offset;
+#endif
+  return writeAll(to,data,size);
+};
+#endif
+
+//Writes the icon file fileName made of the images of the existing icon file with
+//that name and the images in pngdata as described for png2ico_update_file().
+//The file is replaced atomically like in writeIconFile().
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+static int updateIconFile(const char* fileName, const vector<png_data>& pngdata, int numThreads, string& error)
+{
+  vector<unsigned char> fresh(iconSize(pngdata));
+  int status=serializeIcon(pngdata,&fresh[0],numThreads,error);
+  if (status!=PNG2ICO_OK) return status;
+  
+  vector<png_byte> dir;
+  vector<icon_piece> pieces;
+  
+#ifdef _WIN32
+  FILE* oldfile=fopen(fileName,"rb");
+  if (oldfile==NULL && errno==ENOENT) return writeIconFile(fileName,pngdata,numThreads,error);
+  if (oldfile==NULL) {error=formatMessage("%s: %s\n",fileName,strerror(errno)); return PNG2ICO_NOT_ICON;};
+  vector<unsigned char> old;
+  unsigned char buf[65536];
+  size_t n;
+  while((n=fread(buf,1,sizeof(buf),oldfile))>0) old.insert(old.end(),buf,buf+n);
+  bool readError=(ferror(oldfile)!=0);
+  fclose(oldfile);
+  if (readError) {error=formatMessage("%s: %s\n",fileName,strerror(errno)); return PNG2ICO_NOT_ICON;};
+  
+  status=planIconUpdate(old.empty() ? NULL : &old[0],old.size(),fresh,dir,pieces,error);
+  if (status!=PNG2ICO_OK) 
+  {
+    error=formatMessage("%s: %s",fileName,error.c_str());
+    return status;
+  };
+  
+  vector<unsigned char> ico(dir.begin(),dir.end());
+  for (unsigned p=0; p<pieces.size(); ++p) ico.insert(ico.end(),pieces[p].data,pieces[p].data+pieces[p].size);
+  FILE* outfile=fopen(fileName,"wb");
+  if (outfile==NULL) {error=formatMessage("%s: %s\n",fileName,strerror(errno)); return PNG2ICO_WRITE_ERROR;};
+  if (fwrite(&ico[0],ico.size(),1,outfile)!=1)
+  {
+    error=formatMessage("Write error: %s\n",strerror(errno));
+    fclose(outfile);
+    return PNG2ICO_WRITE_ERROR;
+  };
+  if (fclose(outfile)!=0) {error=formatMessage("Write error: %s\n",strerror(errno)); return PNG2ICO_WRITE_ERROR;};
+  return PNG2ICO_OK;
+#else
+  int oldfd=open(fileName,O_RDONLY);
+  if (oldfd<0 && errno==ENOENT) return writeIconFile(fileName,pngdata,numThreads,error);
+  
+  struct stat st;
+  void* old=MAP_FAILED;
+  if (oldfd>=0 && fstat(oldfd,&st)==0 && st.st_size>0) 
+    old=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,oldfd,0);
+  if (old==MAP_FAILED)
+  {
+    error=formatMessage("%s: %s\n",fileName,(oldfd>=0 && st.st_size==0) ? "Not an icon file" : strerror(errno));
+    if (oldfd>=0) close(oldfd);
+    return PNG2ICO_NOT_ICON;
+  };
+  
+  try
+  {
+    status=planIconUpdate((png_const_bytep)old,st.st_size,fresh,dir,pieces,error);
+    if (status!=PNG2ICO_OK) error=formatMessage("%s: %s",fileName,error.c_str());
+  }
+  catch(bad_alloc&) //the mapping must be released below
+  {
+    error="Out of memory\n";
+    status=PNG2ICO_OUT_OF_MEMORY;
+  };
+  
+  output_file out;
+  if (status==PNG2ICO_OK && openOutputFile(fileName,out,error))
+  {
+    bool ok=writeAll(out.fd,&dir[0],dir.size());
+    for (unsigned p=0; ok && p<pieces.size(); ++p)
+    {
+      const icon_piece& piece=pieces[p];
+      if (piece.fromOld) 
+        ok=copyFileRange(oldfd,piece.offset,piece.data,out.fd,piece.size);
+      else
+        ok=writeAll(out.fd,piece.data,piece.size);
+    };
+    
+    if (!ok) error=formatMessage("Write error: %s\n",strerror(errno));
+    if (!closeOutputFile(out,ok,error)) status=PNG2ICO_WRITE_ERROR;
+  }
+  else if (status==PNG2ICO_OK)
+    status=PNG2ICO_WRITE_ERROR;
+  
+  munmap(old,st.st_size);
+  close(oldfd);
+  return status;
+#endif
+};
+
+static void loadImageN(void* jobs, int n)
+{
+  loadImage((*(vector<image_job>*)jobs)[n]);
+};
+
+//Checks the options of image and fills in the settings of job.data accordingly.
+//Returns false and sets job.status and job.error if an option is illegal.
+bool setupImageJob(image_job& job, const png2ico_image& image)
+{
+  //a job left over from an earlier conversion keeps its buffers
+  color_table colors;
+  vector<png_byte> resource;
+  swap(colors,job.data.colors);
+  swap(resource,job.data.resource);
+  job=image_job();
+  colors.clear();
+  resource.clear();
+  swap(colors,job.data.colors);
+  swap(resource,job.data.resource);
+  
+  job.image=&image;
+  job.data.source=&image;
+  if (image.stats!=NULL) *image.stats=png2ico_stats();
+  job.data.format=image.format;
+  job.data.requested_colors=image.colors;
+  job.data.refine_iterations=image.refine;
+  job.data.quantizer=findQuantizer(image.quantizer!=NULL ? image.quantizer : "farthest");
+  
+  if (image.format!=PNG2ICO_PALETTE && image.format!=PNG2ICO_BGRA && image.format!=PNG2ICO_PNG)
+    job.error=formatMessage("%s: Illegal image format\n",image.name);
+  else if (image.colors!=2 && image.colors!=16 && image.colors!=256)
+    job.error=formatMessage("%s: Illegal number of colors\n",image.name);
+  else if (image.size<0 || image.size>256)
+    job.error=formatMessage("%s: Illegal size\n",image.name);
+  else if (image.refine<0)
+    job.error=formatMessage("%s: Illegal number of refinement rounds\n",image.name);
+  else if (job.data.quantizer==NULL)
+    job.error=formatMessage("%s: Unknown quantizer \"%s\"\n",image.name,image.quantizer);
+  else if (image.png==NULL && image.png_size>0)
+    job.error=formatMessage("%s: No image data\n",image.name);
+  
+  if (!job.error.empty())
+  {
+    job.status=PNG2ICO_INVALID_ARGUMENT;
+    return false;
+  };
+  
+  if (image.format!=PNG2ICO_PALETTE) //no palette
+  {
+    job.data.requested_colors=0;
+    job.data.col_bits=32;
+    return true;
+  };
+  
+  for (job.data.col_bits=1; (1<<job.data.col_bits)<image.colors; ++job.data.col_bits);
+  return true;
+};
+
+//Decodes and converts images[0..numImages-1] into jobs and stores the converted
+//images in pngdata in the same order. Returns PNG2ICO_OK or the status of the first
+//image that failed.
+int convertImages(const png2ico_image* images, int numImages, int numThreads,
+                  vector<image_job>& jobs, vector<png_data>& pngdata, string* messages)
+{
+  if (numImages<1 || numImages>word_max)
+  {
+    if (messages!=NULL) *messages+=(numImages<1 ? "No images\n" : "Too many PNG files\n");
+    return PNG2ICO_INVALID_ARGUMENT;
+  };
+  
+  jobs.resize(numImages);
+  for (int n=0; n<numImages; ++n)
+  {
+    if (!setupImageJob(jobs[n],images[n]))
+    {
+      if (messages!=NULL) *messages+=jobs[n].error;
+      return jobs[n].status;
+    };
+  };
+  
+  parallelFor(jobs.size(),numThreads,lookupCacheN,&jobs);
+  
+  //scaled images with the same PNG file share the decoded master image, which is
+  //not needed for images found in the cache
+  vector<master_image> masters;
+  vector<int>& masterOf=threadScratch().masterOf;
+  masterOf.assign(numImages,-1);
+  for (int n=0; n<numImages; ++n)
+  {
+    if (images[n].size==0 || !jobs[n].data.resource.empty()) continue;
+    for (unsigned m=0; m<masters.size() && masterOf[n]<0; ++m)
+      if (masters[m].image->png==images[n].png && masters[m].image->png_size==images[n].png_size) masterOf[n]=m;
+    
+    if (masterOf[n]<0)
+    {
+      masterOf[n]=masters.size();
+      masters.push_back(master_image());
+      masters.back().image=&images[n];
+    };
+  };
+  
+  parallelFor(masters.size(),numThreads,decodeMasterN,&masters);
+  for (int n=0; n<numImages; ++n)
+  {
+    if (masterOf[n]>=0) jobs[n].master=&masters[masterOf[n]];
+    jobs[n].numThreads=max(1,numThreads/numImages); //threads left over from running the images in parallel
+  };
+  
+  parallelFor(jobs.size(),numThreads,loadImageN,&jobs);
+  convertSharedPalettes(jobs);
+  
+  pngdata.resize(jobs.size());
+  for (unsigned n=0; n<jobs.size(); ++n)
+  {
+    image_job& job=jobs[n];
+    if (job.status!=PNG2ICO_OK)
+    {
+      if (messages!=NULL) *messages+=job.error;
+      return job.status;
+    };
+    
+    png2ico_stats* stats=job.image->stats;
+    if (stats!=NULL)
+    {
+      stats->width=job.data.width;
+      stats->height=job.data.height;
+      if (job.data.format==PNG2ICO_PALETTE && !stats->cached) stats->palette_size=job.data.num_palette;
+    };
+    
+    if (job.data.tooManyColors && messages!=NULL)
+    {
+      *messages+=formatMessage("%s: Warning! Color reduction may not be optimal!\nIf the result is not satisfactory, reduce the number of colors\nbefore using png2ico.\n",job.image->name);
+    };
+    
+    swap(pngdata[n],job.data);
+  };
+  
+  return PNG2ICO_OK;
+};
+
+//Ends a conversion run with scratch.jobs and scratch.pngdata. The images keep
+//their buffers for the next conversion on the calling thread, except for the
+//pixels of scaled images and the images beyond the first max_kept_images.
+static void finishConversion(scratch_buffers& scratch)
+{
+  if (scratch.jobs.size()>max_kept_images) scratch.jobs.resize(max_kept_images);
+  if (scratch.pngdata.size()>max_kept_images) scratch.pngdata.resize(max_kept_images);
+  for (unsigned n=0; n<scratch.jobs.size(); ++n) scratch.jobs[n].data.pixels.reset();
+  for (unsigned n=0; n<scratch.pngdata.size(); ++n) scratch.pngdata[n].pixels.reset();
+};
+
+};
+
+using namespace png2ico_internal;
+
+int png2ico_convert(const png2ico_image* images, int numImages, int numThreads,
+                    vector<unsigned char>& ico, string* messages)
+{
+  ico.clear();
+  
+  scratch_buffers& scratch=threadScratch();
+  vector<png_data>& pngdata=scratch.pngdata;
+  int status=convertImages(images,numImages,numThreads,scratch.jobs,pngdata,messages);
+  
+  if (status==PNG2ICO_OK)
+  {
+    try
+    {
+      ico.resize(iconSize(pngdata));
+      string error;
+      status=serializeIcon(pngdata,&ico[0],numThreads,error);
+      if (messages!=NULL) *messages+=error;
+    }
+    catch(bad_alloc&)
+    {
+      if (messages!=NULL) *messages+="Out of memory\n";
+      status=PNG2ICO_OUT_OF_MEMORY;
+    };
+    if (status!=PNG2ICO_OK) vector<unsigned char>().swap(ico);
+  };
+  
+  finishConversion(scratch);
+  return status;
+};
+
+int png2ico_convert_to_file(const png2ico_image* images, int numImages, int numThreads,
+                            const char* fileName, string* messages)
+{
+  scratch_buffers& scratch=threadScratch();
+  vector<png_data>& pngdata=scratch.pngdata;
+  int status=convertImages(images,numImages,numThreads,scratch.jobs,pngdata,messages);
+  
+  if (status==PNG2ICO_OK)
+  {
+    string error;
+    try
+    {
+      status=writeIconFile(fileName,pngdata,numThreads,error);
+    }
+    catch(bad_alloc&)
+    {
+      error="Out of memory\n";
+      status=PNG2ICO_OUT_OF_MEMORY;
+    };
+    if (messages!=NULL) *messages+=error;
+  };
+  
+  finishConversion(scratch);
+  return status;
+};
+
+int png2ico_update_file(const png2ico_image* images, int numImages, int numThreads,
+                        const char* fileName, string* messages)
+{
+  scratch_buffers& scratch=threadScratch();
+  vector<png_data>& pngdata=scratch.pngdata;
+  int status=convertImages(images,numImages,numThreads,scratch.jobs,pngdata,messages);
+  
+  if (status==PNG2ICO_OK)
+  {
+    string error;
+    try
+    {
+      status=updateIconFile(fileName,pngdata,numThreads,error);
+    }
+    catch(bad_alloc&)
+    {
+      error="Out of memory\n";
+      status=PNG2ICO_OUT_OF_MEMORY;
+    };
+    if (messages!=NULL) *messages+=error;
+  };
+  
+  finishConversion(scratch);
+  return status;
+};
+
+//an icon file opened with png2ico_open()
+struct png2ico_icon
+{
+  string name;             //used in messages
+  png_const_bytep data;    //contents of the icon file
+  size_t size;             //number of bytes at data
+  bool mapped;             //true if data is a memory mapping that has to be unmapped
+  vector<unsigned char> contents; //the contents if they are neither mapped nor provided by the caller
+  vector<icon_entry> entries;
+  vector<png2ico_entry> info; //the public part of entries
+  png2ico_icon():data(NULL),size(0),mapped(false){};
+};
+
+//Decodes the bitmap image resource of entry of icon to 8 bit RGBA in image.
+//Pixels whose bit in the AND mask is set become transparent. 32 bit images have
+//their own alpha channel, but images in which all pixels have alpha 0 are
+//written by programs that ignore it, so that the AND mask is used for them, too.
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+static int decodeBitmap(const png2ico_icon& icon, const icon_entry& entry, rgba_image& image, string& error)
+{
+  png_const_bytep res=icon.data+entry.offset;
+  unsigned int headerSize=getDWord(res);
+  int bits=entry.col_bits;
+  unsigned int numColors=getDWord(res+32);
+  if (bits<=8 && (numColors==0 || numColors>(1u<<bits))) numColors=1u<<bits;
+  if (bits>8) numColors=0;
+  
+  if ((bits!=1 && bits!=4 && bits!=8 && bits!=24 && bits!=32) || getDWord(res+16)!=0 ||
+      (int)getDWord(res+8)<0 || entry.width<1 || entry.width>word_max || entry.height<1 || entry.height>word_max)
+  {
+    error=formatMessage("%s: Unsupported image format\n",icon.name.c_str());
+    return PNG2ICO_UNSUPPORTED;
+  };
+  
+  size_t xorLineLen=((entry.width*bits+31)>>5)<<2;
+  size_t andLineLen=((entry.width+31)>>5)<<2;
+  size_t xorOffset=(size_t)headerSize+4*numColors;
+  size_t andOffset=xorOffset+xorLineLen*entry.height;
+  bool hasAndMask=(andOffset+andLineLen*entry.height<=entry.size);
+  if (headerSize<40 || andOffset>entry.size || (!hasAndMask && bits!=32))
+  {
+    error=formatMessage("%s: Truncated image\n",icon.name.c_str());
+    return PNG2ICO_NOT_ICON;
+  };
+  
+  image.width=entry.width;
+  image.height=entry.height;
+  image.pixels.resize((size_t)image.width*image.height*4);
+  png_const_bytep palette=res+headerSize;
+  bool anyAlpha=false;
+  for (png_uint_32 y=0; y<image.height; ++y)
+  {
+    png_const_bytep xorLine=res+xorOffset+xorLineLen*(image.height-1-y); //the bitmap is stored bottom-up
+    png_bytep out=&image.pixels[(size_t)y*image.width*4];
+    for (png_uint_32 x=0; x<image.width; ++x, out+=4)
+    {
+      png_const_bytep bgr;
+      if (bits<=8)
+      {
+        unsigned int bit=x*bits;
+        unsigned int index=(xorLine[bit>>3]>>(8-bits-(bit&7)))&((1<<bits)-1);
+        static const png_byte black[4]={0,0,0,0};
+        bgr=(index<numColors ? palette+4*index : black);
+        out[3]=255;
+      }
+      else
+      {
+        bgr=xorLine+x*(bits>>3);
+        out[3]=(bits==32 ? bgr[3] : 255);
+        if (out[3]!=0 && bits==32) anyAlpha=true;
+      };
+      out[0]=bgr[2];
+      out[1]=bgr[1];
+      out[2]=bgr[0];
+    };
+  };
+  
+  if (!hasAndMask || (bits==32 && anyAlpha)) return PNG2ICO_OK;
+  
+  for (png_uint_32 y=0; y<image.height; ++y)
+  {
+    png_const_bytep andLine=res+andOffset+andLineLen*(image.height-1-y);
+    png_bytep out=&image.pixels[(size_t)y*image.width*4];
+    for (png_uint_32 x=0; x<image.width; ++x, out+=4)
+      out[3]=((andLine[x>>3]>>(7-(x&7)))&1) ? 0 : 255;
+  };
+  
+  return PNG2ICO_OK;
+};
+
+//Decodes the PNG image resource of entry of icon to 8 bit RGBA in image.
+//Returns a PNG2ICO_ status and sets error if it is not PNG2ICO_OK.
+static int decodeEmbeddedPNG(const png2ico_icon& icon, const icon_entry& entry, rgba_image& image, string& error)
+{
+  png_reader reader;
+  bool ok=openPNG(reader,icon.data+entry.offset,entry.size,READ_RGBA);
+  if (ok)
+  {
+    image.width=reader.width;
+    image.height=reader.height;
+    image.pixels.resize(reader.rowbytes*reader.height);
+    for (png_uint_32 y=0; ok && y<reader.height; ++y)
+    {
+      png_bytep buf=&image.pixels[reader.rowbytes*y];
+      png_const_bytep row=readRow(reader,buf);
+      if (row==NULL) ok=false;
+      else if (row!=buf) memcpy(buf,row,reader.rowbytes);
+    };
+  };
+  
+  if (ok) return PNG2ICO_OK;
+  error=formatMessage("%s: PNG error: %s\n",icon.name.c_str(),reader.error.c_str());
+  return PNG2ICO_PNG_ERROR;
+};
+
+//Reads the directory of icon->data and stores icon in *result. Deletes icon and
+//returns a PNG2ICO_ status if data is not an icon file.
+static int finishOpen(png2ico_icon* icon, png2ico_icon** result, string* messages)
+{
+  if (!readIconDirectory(icon->data,icon->size,icon->entries))
+  {
+    if (messages!=NULL) *messages+=formatMessage("%s: Not an icon file\n",icon->name.c_str());
+    png2ico_close(icon);
+    return PNG2ICO_NOT_ICON;
+  };
+  
+  icon->info.resize(icon->entries.size());
+  for (unsigned n=0; n<icon->entries.size(); ++n)
+  {
+    const icon_entry& entry=icon->entries[n];
+    icon->info[n].width=entry.width;
+    icon->info[n].height=entry.height;
+    icon->info[n].bits=entry.col_bits;
+    icon->info[n].png=entry.png;
+    icon->info[n].size=entry.size;
+  };
+  *result=icon;
+  return PNG2ICO_OK;
+};
+
+int png2ico_open(const char* fileName, png2ico_icon** result, string* messages)
+{
+  *result=NULL;
+  png2ico_icon* icon=NULL;
+  try
+  {
+    icon=new png2ico_icon;
+    icon->name=fileName;
+#ifdef _WIN32
+    FILE* f=fopen(fileName,"rb");
+    bool ok=(f!=NULL);
+    if (ok)
+    {
+      unsigned char buf[65536];
+      size_t n;
+      while((n=fread(buf,1,sizeof(buf),f))>0) icon->contents.insert(icon->contents.end(),buf,buf+n);
+      if (ferror(f)) ok=false;
+      fclose(f);
+    };
+    icon->data=icon->contents.empty() ? NULL : &icon->contents[0];
+    icon->size=icon->contents.size();
+#else
+    int fd=open(fileName,O_RDONLY);
+    struct stat st;
+    bool ok=(fd>=0 && fstat(fd,&st)==0);
+    if (ok && st.st_size>0)
+    {
+      //only the directory and the requested images are paged in
+      void* map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+      if (map==MAP_FAILED) 
+        ok=false;
+      else
+      {
+        madvise(map,st.st_size,MADV_RANDOM);
+        icon->data=(png_const_bytep)map;
+        icon->size=st.st_size;
+        icon->mapped=true;
+      };
+    };
+    if (fd>=0) close(fd);
+#endif
+    if (!ok)
+    {
+      if (messages!=NULL) *messages+=formatMessage("%s: %s\n",fileName,strerror(errno));
+      png2ico_close(icon);
+      return PNG2ICO_NOT_ICON;
+    };
+    return finishOpen(icon,result,messages);
+  }
+  catch(bad_alloc&)
+  {
+    png2ico_close(icon);
+    if (messages!=NULL) *messages+="Out of memory\n";
+    return PNG2ICO_OUT_OF_MEMORY;
+  };
+};
+
+int png2ico_open_memory(const void* data, size_t size, const char* name, png2ico_icon** result, string* messages)
+{
+  *result=NULL;
+  png2ico_icon* icon=NULL;
+  try
+  {
+    icon=new png2ico_icon;
+    icon->name=name;
+    icon->data=(png_const_bytep)data;
+    icon->size=size;
+    return finishOpen(icon,result,messages);
+  }
+  catch(bad_alloc&)
+  {
+    png2ico_close(icon);
+    if (messages!=NULL) *messages+="Out of memory\n";
+    return PNG2ICO_OUT_OF_MEMORY;
+  };
+};
+
+void png2ico_close(png2ico_icon* icon)
+{
+  if (icon==NULL) return;
+#ifndef _WIN32
+  if (icon->mapped) munmap((void*)icon->data,icon->size);
+#endif
+  delete icon;
+};
+
+int png2ico_num_entries(const png2ico_icon* icon)
+{
+  return icon->info.size();
+};
+
+const png2ico_entry* png2ico_get_entry(const png2ico_icon* icon, int n)
+{
+  if (n<0 || n>=(int)icon->info.size()) return NULL;
+  return &icon->info[n];
+};
+
+int png2ico_best_entry(const png2ico_icon* icon, int size)
+{
+  int best=-1;
+  int bestSize=0;
+  int bestBits=0;
+  for (unsigned n=0; n<icon->info.size(); ++n)
+  {
+    int entrySize=max(icon->info[n].width,icon->info[n].height);
+    int bits=icon->info[n].bits;
+    bool better;
+    if (best<0) 
+      better=true;
+    else if (entrySize==bestSize)
+      better=(bits>bestBits);
+    else if (entrySize>=size && bestSize>=size) //both large enough: the smaller is scaled down less
+      better=(entrySize<bestSize);
+    else //at most one is large enough: prefer it, otherwise the larger one
+      better=(entrySize>bestSize);
+    
+    if (better)
+    {
+      best=n;
+      bestSize=entrySize;
+      bestBits=bits;
+    };
+  };
+  return best;
+};
+
+int png2ico_decode_entry(const png2ico_icon* icon, int n, vector<unsigned char>& rgba, string* messages)
+{
+  rgba.clear();
+  if (n<0 || n>=(int)icon->entries.size())
+  {
+    if (messages!=NULL) *messages+=formatMessage("%s: No such image\n",icon->name.c_str());
+    return PNG2ICO_INVALID_ARGUMENT;
+  };
+  
+  string error;
+  int status;
+  try
+  {
+    rgba_image image;
+    const icon_entry& entry=icon->entries[n];
+    if (entry.png)
+      status=decodeEmbeddedPNG(*icon,entry,image,error);
+    else
+      status=decodeBitmap(*icon,entry,image,error);
+    if (status==PNG2ICO_OK) rgba.swap(image.pixels);
+  }
+  catch(bad_alloc&)
+  {
+    error="Out of memory\n";
+    status=PNG2ICO_OUT_OF_MEMORY;
+  };
+  
+  if (messages!=NULL) *messages+=error;
+  return status;
+};
+
+int png2ico_entry_to_png(const png2ico_icon* icon, int n, vector<unsigned char>& png, string* messages)
+{
+  png.clear();
+  if (n>=0 && n<(int)icon->entries.size() && icon->entries[n].png)
+  {
+    const icon_entry& entry=icon->entries[n];
+    try
+    {
+      png.assign(icon->data+entry.offset,icon->data+entry.offset+entry.size);
+    }
+    catch(bad_alloc&)
+    {
+      if (messages!=NULL) *messages+="Out of memory\n";
+      return PNG2ICO_OUT_OF_MEMORY;
+    };
+    return PNG2ICO_OK;
+  };
+  
+  rgba_image image;
+  int status=png2ico_decode_entry(icon,n,image.pixels,messages);
+  if (status!=PNG2ICO_OK) return status;
+  
+  image.width=icon->info[n].width;
+  image.height=icon->info[n].height;
+  string error;
+  if (!encodePNG(image,png,error))
+  {
+    if (messages!=NULL) *messages+=formatMessage("%s: PNG error: %s\n",icon->name.c_str(),error.c_str());
+    return PNG2ICO_PNG_ERROR;
+  };
+  return PNG2ICO_OK;
+};
+
+const char* png2ico_strerror(int status)
+{
+  switch(status)
+  {
+    case PNG2ICO_OK:               return "Success";
+    case PNG2ICO_INVALID_ARGUMENT: return "Invalid argument";
+    case PNG2ICO_NOT_PNG:          return "Not a PNG file";
+    case PNG2ICO_PNG_ERROR:        return "PNG error";
+    case PNG2ICO_UNSUPPORTED:      return "Image not supported";
+    case PNG2ICO_OUT_OF_MEMORY:    return "Out of memory";
+    case PNG2ICO_WRITE_ERROR:      return "Write error";
+    case PNG2ICO_NOT_ICON:         return "Not an icon file";
+  };
+  return "Unknown error";
+};
@@ -0,0 +1,195 @@
+/* Copyright (C) 2002 Matthias S. Benkmann <matthias@winterdrache.de>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; version 2
+of the License (ONLY THIS VERSION).
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+/*
+libpng2ico converts PNG images held in memory to a Windows .ICO icon resource
+held in memory. It can also read the images of existing icon files. It never
+prints anything and never terminates the program. Errors are reported through
+the return value of png2ico_convert() and the messages it produces. All
+functions may be called from several threads at the same time, as long as
+they do not use the same png2ico_icon.
+*/
+
+#ifndef LIBPNG2ICO_H
+#define LIBPNG2ICO_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//how an image is stored in the icon
+enum png2ico_format
+{
+  PNG2ICO_PALETTE=0, //bitmap with 2, 16 or 256 colors and a 1 bit transparency mask
+  PNG2ICO_BGRA,      //32 bit bitmap with alpha channel
+  PNG2ICO_PNG        //the PNG file itself, without decoding it (Windows Vista and later)
+};
+
+//A directory that keeps converted images, so that converting the same PNG file
+//with the same settings again only needs to copy the stored result. Several
+//processes can use the same directory at the same time.
+struct png2ico_cache
+{
+  const char* dir;     //the directory, which must exist
+  long long max_size;  //if >0, the least recently used images are removed when the cache grows beyond max_size bytes
+  png2ico_cache():dir(NULL),max_size(0){};
+};
+
+//wall clock and CPU time spent in a phase of the conversion, in seconds
+struct png2ico_time
+{
+  double wall;
+  double cpu;  //CPU time of all threads working on the phase (0 on Windows)
+  png2ico_time():wall(0),cpu(0){};
+};
+
+//Statistics about the conversion of an image (see png2ico_image::stats). The
+//quantization statistics are only filled in for PNG2ICO_PALETTE images. Images 
+//with shared_palette report the palette and mapping of the whole group with the
+//first image of the group.
+struct png2ico_stats
+{
+  png2ico_time decode;    //decoding (and scaling) the PNG file in both passes over the image, or reading it from the cache
+  png2ico_time histogram; //gathering the colors of the image
+  png2ico_time palette;   //choosing the palette
+  png2ico_time mapping;   //mapping the colors to palette entries and refining the palette
+  png2ico_time write;     //storing the image in the icon
+  int width, height;
+  bool cached;            //true if the image was taken from the cache, so that it was neither decoded nor quantized
+  int unique_colors;      //number of different colors of the image, with all transparent pixels counted as one
+  int palette_size;       //number of palette entries in use
+  int max_distance;       //largest quadratic RGB distance between a color and its palette entry
+  double mean_distance;   //quadratic RGB distance between a pixel and its palette entry averaged over all non-transparent pixels
+  png2ico_stats():width(0),height(0),cached(false),unique_colors(0),palette_size(0),max_distance(0),mean_distance(0){};
+};
+
+//an image to be stored in an icon
+struct png2ico_image
+{
+  const char* name;       //name of the image used in messages (e.g. the file name)
+  const void* png;        //contents of the PNG file
+  size_t png_size;        //number of bytes at png
+  int format;             //one of png2ico_format
+  int size;               //if not 0, the image is scaled so that its larger side has size pixels
+  int colors;             //number of palette entries in the icon: 2, 16 or 256
+  int refine;             //number of k-means rounds to improve the palette with
+  const char* quantizer;  //color reduction algorithm: "farthest", "mediancut" or "wu"
+  bool shared_palette;    //if true, the image gets the same palette as the other images with shared_palette and the same colors, refine and quantizer
+  const png2ico_cache* cache; //if not NULL, the converted image is taken from or stored in this cache
+  png2ico_stats* stats;   //if not NULL, receives statistics about the conversion. Every image needs its own.
+  png2ico_image():name(""),png(NULL),png_size(0),format(PNG2ICO_PALETTE),size(0),colors(256),
+                  refine(0),quantizer("farthest"),shared_palette(false),cache(NULL),stats(NULL){};
+};
+
+//return values of png2ico_convert()
+enum png2ico_status
+{
+  PNG2ICO_OK=0,
+  PNG2ICO_INVALID_ARGUMENT, //illegal option in a png2ico_image or no images at all
+  PNG2ICO_NOT_PNG,          //data does not start with the PNG signature
+  PNG2ICO_PNG_ERROR,        //libpng could not decode the image
+  PNG2ICO_UNSUPPORTED,      //the image is valid but can not be stored in an icon
+  PNG2ICO_OUT_OF_MEMORY,
+  PNG2ICO_WRITE_ERROR,      //the icon file could not be written
+  PNG2ICO_NOT_ICON          //the icon file to be updated could not be read or is not an icon
+};
+
+//Creates an icon from the numImages images at images and stores the .ICO
+//file in ico (replacing its previous contents). Up to numThreads images are
+//decoded and converted in parallel. The colors, refine, quantizer and 
+//shared_palette settings only apply to images stored as PNG2ICO_PALETTE.
+//Images that are scaled and have the same png pointer are decoded only once.
+//Images with a cache are looked up by a hash of their PNG file and settings and
+//are only decoded if they are not found. Images with shared_palette are never
+//cached. Caching is not available on Windows, where the cache is ignored.
+//The statistics of images with stats are reset and then filled in while the
+//image is converted and stored in the icon.
+//Warnings and error messages are appended to messages (if not NULL), each
+//terminated by a newline.
+//Returns PNG2ICO_OK on success. Otherwise the status of the first image that
+//could not be converted is returned and ico is left empty.
+int png2ico_convert(const png2ico_image* images, int numImages, int numThreads,
+                    std::vector<unsigned char>& ico, std::string* messages);
+
+//Like png2ico_convert() but writes the .ICO file to fileName. A regular file is
+//replaced atomically, i.e. it either keeps its old contents or contains the
+//complete icon, and keeps its mode and (if possible) owner. If fileName is a
+//symlink, its target is replaced. Other files like /dev/stdout are written directly.
+int png2ico_convert_to_file(const png2ico_image* images, int numImages, int numThreads,
+                            const char* fileName, std::string* messages);
+
+//Like png2ico_convert_to_file() but keeps the images of the existing icon file
+//fileName. An image of the file is replaced by the first of images that has the
+//same width, height and bit depth. The other images are added after the images
+//of the file. The images that are kept are copied without being decoded, and on
+//Linux without even being read into memory. If fileName does not exist, it is
+//created.
+int png2ico_update_file(const png2ico_image* images, int numImages, int numThreads,
+                        const char* fileName, std::string* messages);
+
+//an image in the directory of an icon file
+struct png2ico_entry
+{
+  int width, height;
+  int bits;       //bits per pixel, at most 32 (also for PNG images with 16 bit channels)
+  bool png;       //true if the image is stored as PNG file
+  size_t size;    //number of bytes the image takes up in the file
+};
+
+//an icon file opened for reading (see png2ico_open())
+struct png2ico_icon;
+
+//Opens the icon file fileName for reading and stores a handle for it in *icon,
+//which must be released with png2ico_close(). Only the directory of the file is
+//read; the file is memory mapped and each image is only read and decoded when it
+//is requested. Errors are appended to messages (if not NULL).
+//Returns PNG2ICO_OK on success, otherwise *icon is NULL.
+int png2ico_open(const char* fileName, png2ico_icon** icon, std::string* messages);
+
+//Like png2ico_open() for the icon file of size bytes at data, which must remain
+//valid until png2ico_close(). name is used in messages.
+int png2ico_open_memory(const void* data, size_t size, const char* name, png2ico_icon** icon,
+                        std::string* messages);
+
+void png2ico_close(png2ico_icon* icon);
+
+//returns the number of images in icon
+int png2ico_num_entries(const png2ico_icon* icon);
+
+//returns the directory entry of image n of icon or NULL if there is no such image
+const png2ico_entry* png2ico_get_entry(const png2ico_icon* icon, int n);
+
+//Returns the image of icon that is best suited to be displayed with size x size
+//pixels, i.e. the smallest image that is at least that large or the largest
+//image if none is. Of images with the same size the one with more bits per pixel
+//is chosen. Returns -1 if icon has no images.
+int png2ico_best_entry(const png2ico_icon* icon, int size);
+
+//Decodes image n of icon and stores its pixels top-down as 8 bit RGBA in rgba,
+//i.e. width*height*4 bytes. Errors are appended to messages (if not NULL).
+int png2ico_decode_entry(const png2ico_icon* icon, int n, std::vector<unsigned char>& rgba,
+                         std::string* messages);
+
+//Stores image n of icon as PNG file in png. Images that are stored as PNG file
+//are copied without decoding them. Errors are appended to messages (if not NULL).
+int png2ico_entry_to_png(const png2ico_icon* icon, int n, std::vector<unsigned char>& png,
+                         std::string* messages);
+
+//returns a short description of status
+const char* png2ico_strerror(int status);
+
+#endif
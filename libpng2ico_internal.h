@@ -0,0 +1,170 @@
+/* Copyright (C) 2002 Matthias S. Benkmann <matthias@winterdrache.de>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; version 2
+of the License (ONLY THIS VERSION).
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+/*
+The internal data structures and steps of the conversion in libpng2ico. They
+are not part of the interface of the library (see libpng2ico.h) and may change
+at any time. Only png2ico-bench uses them, to measure the steps one by one.
+They live in the namespace png2ico_internal, so that they cannot clash with the
+names of programs linked with the library. Everything else in libpng2ico.cpp is
+static or in an anonymous namespace.
+*/
+
+#ifndef LIBPNG2ICO_INTERNAL_H
+#define LIBPNG2ICO_INTERNAL_H
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <png.h>
+
+#include "libpng2ico.h"
+
+//the SSE2 and AVX2 row kernels need GCC's (or clang's) target attribute and CPU detection
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PNG2ICO_X86_KERNELS
+#endif
+
+namespace png2ico_internal {
+
+class Quantizer;
+struct master_image;
+
+//all colors of an image, sorted by quad and without duplicates
+struct color_table
+{
+  std::vector<unsigned int> quad;    //the color as red+(green<<8)+(blue<<16)+(alpha<<24)
+  std::vector<unsigned int> count;   //number of pixels that have color quad[n]
+  std::vector<signed int> palEntry;  //palette entry quad[n] is mapped to, -1 if not mapped yet
+  
+  unsigned int size() const {return quad.size();};
+  
+  //removes all colors, but keeps the buffers
+  void clear() {quad.clear(); count.clear(); palEntry.clear();};
+  
+  //returns the index of q in quad, which must contain it
+  unsigned int find(unsigned int q) const 
+  {
+    return std::lower_bound(quad.begin(),quad.end(),q)-quad.begin();
+  };
+};
+
+//an 8 bit RGBA image in memory
+struct rgba_image
+{
+  png_uint_32 width, height;
+  std::vector<png_byte> pixels;
+  rgba_image():width(0),height(0){};
+};
+
+//An image of the icon. The pixels of a PNG file are not kept in memory. They are
+//decoded once to gather the colors and a second time when the icon is serialized.
+//Only scaled images are kept in memory.
+struct png_data
+{
+  const png2ico_image* source; //the PNG file the image is decoded from
+  int format; //how the image is stored in the icon (png2ico_format)
+  png_uint_32 width, height;
+  bool hasAlpha;
+  bool indexed; //true if the PNG file is palette based. Its pixels are then read as indices into indexQuad.
+  unsigned int indexQuad[256]; //the colors of the PNG palette as stored in color_table
+  png_color palette[256]; //must have room for 256 entries because serializeIcon() writes requested_colors of them
+  int num_palette;
+  int requested_colors;
+  int col_bits;
+  int refine_iterations; //number of k-means rounds to run on the palette
+  const Quantizer* quantizer; //algorithm that chooses the palette
+  color_table colors; //all colors of the image and the palette entries they are mapped to
+  std::shared_ptr<rgba_image> pixels; //if the image is scaled, its pixels are read from here instead of being decoded from source
+  bool tooManyColors; //result of convertToIndexed()
+  std::vector<png_byte> resource; //the complete image resource if serializeIcon() only has to copy it, i.e. a scaled image encoded as PNG file or an image from the cache
+  std::string cacheKey; //if not empty, serializeIcon() stores the image in source->cache under this name
+  png_data():source(NULL),format(PNG2ICO_PALETTE),width(0),height(0),hasAlpha(false),indexed(false),num_palette(0),
+             requested_colors(0),col_bits(0),refine_iterations(0),quantizer(NULL),tooManyColors(false)
+  {
+    memset(indexQuad,0,sizeof(indexQuad));
+    memset(palette,0,sizeof(palette));
+  };
+};
+
+//an input image of the icon together with the settings it is converted with
+struct image_job
+{
+  const png2ico_image* image;
+  const master_image* master; //the decoded PNG file if the image is scaled, NULL otherwise
+  int numThreads;     //number of threads the image may use by itself
+  png_data data;
+  int status;         //PNG2ICO_OK or the reason why the image could not be converted
+  std::string error;       //message describing status
+  image_job():image(NULL),master(NULL),numThreads(1),status(PNG2ICO_OK){};
+};
+
+//an image whose masks are stored during serializeIcon()
+struct mask_job
+{
+  const png_data* img;
+  png_bytep resource; //start of the image resource
+  png_bytep xorMask;
+  png_bytep andMask;
+  int numThreads; //number of threads the image may use by itself
+  int status;
+  std::string error;
+};
+
+//A fast non-cryptographic 128 bit hash made of 2 independent 64 bit lanes. It is
+//used to name the files of a png2ico_cache.
+struct hash128
+{
+  unsigned long long lo, hi;
+  hash128():lo(0x243F6A8885A308D3ull),hi(0x13198A2E03707344ull){};
+  void add(const void* data, size_t size);
+};
+
+//The steps of the conversion that png2ico-bench measures. They are documented 
+//where they are defined in libpng2ico.cpp.
+int andMaskLineLen(const png_data& img);
+int xorMaskLineLen(const png_data& img);
+int pack(png_const_bytep row,int width,int nbits,png_bytep out);
+int alphaMask(png_const_bytep rgba,int width,png_bytep mask);
+#ifdef PNG2ICO_X86_KERNELS
+int packSSE2(png_const_bytep row,int width,int nbits,png_bytep out);
+int alphaMaskSSE2(png_const_bytep rgba,int width,png_bytep mask);
+int packAVX2(png_const_bytep row,int width,int nbits,png_bytep out);
+int alphaMaskAVX2(png_const_bytep rgba,int width,png_bytep mask);
+#endif
+bool setupImageJob(image_job& job, const png2ico_image& image);
+bool loadColors(image_job& job);
+void loadImage(image_job& job);
+bool convertToIndexed(png_data& img);
+void storeImageResource(mask_job& job);
+size_t iconSize(const std::vector<png_data>& pngdata);
+int serializeIcon(const std::vector<png_data>& pngdata, png_bytep out, int numThreads, std::string& error);
+int convertImages(const png2ico_image* images, int numImages, int numThreads,
+                  std::vector<image_job>& jobs, std::vector<png_data>& pngdata, std::string* messages);
+
+//the libpng callbacks of the library, which png2ico-bench also uses to encode its images
+void storePNGError(png_structp png_ptr, png_const_charp msg);
+void ignorePNGWarning(png_structp, png_const_charp);
+void writeToVector(png_structp png_ptr, png_bytep data, png_size_t length);
+
+};
+
+#endif
@@ -1,23 +1,3 @@
-/*
-TODO:
->When feeding the image ms26.png (see message "what's wrong with this
->image") to png2ico I get the message
->
->libpng error: Read error
->
->How do I suppress the outputting of this message? I was surprised that
->libpng outputs a message in addition to jumping to the setjmp error
->handler (which outputs its own message). Do I need to write my own error
->handling functions or is there a simpler way (of course I don't want to
->recompile libpng itself)?
-
-That message is the message printed by the setjmp error handler.
-
-You can replace the error handler without recompiling libpng.  Just
-include a pointer to your error handler in png_read_create_struct().
-See for example pngtest.c which illustrates replacing the error handler.
-*/
-
 /* Copyright (C) 2002 Matthias S. Benkmann <matthias@winterdrache.de>
 
 This program is free software; you can redistribute it and/or
@@ -35,611 +15,1481 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 
-/*
-Notes about transparent and inverted pixels:
- Handling of transparent pixels is inconsistent in Windows. Sometimes a
- pixel with an AND mask value of 1 is just transparent (i.e. its color 
- value is ignored), sometimes the color value is XORed with the background to
- give some kind of inverted effect. A closer look at bmp.txt suggests that
- the latter behaviour is the correct one but because it often doesn't happen
- it's de facto undefined behaviour.
- Furthermore, sometimes the AND mask entry seems to be interpreted as a
- color index, i.e. a value of 1 will AND the background with color 1.
- Conclusion: The most robust solution seems to be:
-               -color 0 always 0,0,0
-               -color 1 always 255,255,255
-               -all transparent pixels get color 0
-*/
-
+//Command line interface of png2ico. The conversion itself is done by libpng2ico.
 
 #include <cstdio>
+#include <cstdlib>
+#include <cerrno>
 #include <vector>
+#include <string>
 #include <climits>
 #include <cstring>
+#include <deque>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
-#if __GNUC__ > 2
-#include <ext/hash_map>
-#else
-#include <hash_map>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
 #endif
 
-#include <png.h>
+#include "libpng2ico.h"
 
 #include "VERSION"
 
 using namespace std;
-namespace __gnu_cxx{};
-using namespace __gnu_cxx;
 
 const int word_max=65535;
-const int transparency_threshold=196;
-const int color_reduce_warning_threshold=512; //maximum quadratic euclidean distance in RGB color space that a palette color may have to a source color assigned to it before a warning is issued
-const unsigned int slow_reduction_warn_threshold=262144; //number of colors in source image times number of colors in target image that triggers the warning that the reduction may take a while
+const long long default_cache_size=100*1048576LL; //maximum size of the --cache-dir if --cache-size is not given
+const int serve_timeout=30; //seconds --serve gives a client to send a request and receive the response, or to stay idle
+const int max_clients=512; //--serve accepts no more connections while this many are open
+const size_t max_request_line=65536; //maximum length of the first line of a --serve request
+const size_t max_request_size=64*1048576; //maximum total size of the PNG files of a --serve request
+const size_t mmap_read_threshold=65536; //PNG files of at least this size are memory mapped instead of read
+
+const char* const quantizerNames[]={"farthest","mediancut","wu"};
+const char* const formatNames[]={"palette","bgra","png"}; //indexed by png2ico_format
 
-void writeWord(FILE* f, int word)
+//what --stats prints
+enum stats_mode
 {
-  char data[2];
-  data[0]=(word&255);
-  data[1]=(word>>8)&255;
-  if (fwrite(data,2,1,f)!=1) {perror("Write error"); exit(1);};
+  STATS_NONE=0,
+  STATS_TEXT,  //a readable summary on stderr
+  STATS_JSON   //a JSON object per icon on stdout
 };
 
-void writeDWord(FILE* f, unsigned int dword)
+//settings that apply to all icons
+struct convert_options
 {
-  char data[4];
-  data[0]=(dword&255);
-  data[1]=(dword>>8)&255;
-  data[2]=(dword>>16)&255;
-  data[3]=(dword>>24)&255;
-  if (fwrite(data,4,1,f)!=1) {perror("Write error"); exit(1);};
+  int numThreads;
+  const png2ico_cache* cache; //if not NULL, converted images are taken from and stored in it
+  int stats;                  //one of stats_mode
+  convert_options():numThreads(1),cache(NULL),stats(STATS_NONE){};
 };
 
-void writeByte(FILE* f, int byte)
+//The contents of a PNG file. data points either into buffer or into a memory 
+//mapping of the file, which must be released with releaseInput().
+struct input_file
 {
-  char data[1];
-  data[0]=(byte&255);
-  if (fwrite(data,1,1,f)!=1) {perror("Write error"); exit(1);};
+  const void* data;
+  size_t size;
+  vector<unsigned char> buffer;
+  void* mapping; //start of the mapping or NULL if the file is not mapped
+  input_file():data(""),size(0),mapping(NULL){};
 };
 
-
-
-struct png_data
+//an icon file to be created from a list of PNG files
+struct icon_job
 {
-  png_structp png_ptr;
-  png_infop info_ptr;
-  png_infop end_info;
-  png_uint_32 width, height;
-  png_colorp palette;
-  png_bytepp transMap;
-  int num_palette;
-  int requested_colors;
-  int col_bits;
-  png_data():png_ptr(NULL),info_ptr(NULL),end_info(NULL),width(0),height(0),
-             palette(NULL),transMap(NULL),num_palette(0),requested_colors(0),col_bits(0){};
+  string outfileName;
+  bool update; //true if the images are added to the existing icon file outfileName
+  vector<string> fileNames;
+  vector<int> fileIndex; //images[n] is created from the fileIndex[n]th PNG file on the command line
+  vector<string> imageNames; //fileNames[n] plus the size if the image is scaled
+  vector<png2ico_image> images; //images[n].name and png point into imageNames[n] and contents[n]
+  vector<input_file> contents; //contents of the PNG files
+  vector<png2ico_stats> stats; //statistics of images[n] if requested with --stats
+  int line; //line of the icon in the batch manifest
+  icon_job():update(false),line(0){};
 };
 
-int andMaskLineLen(const png_data& img)
+//returns prefix and the message for the current errno in the format used by perror()
+string errnoMessage(const char* prefix)
 {
-  int len=(img.width+7)>>3;
-  return (len+3)&~3;
+  string msg=prefix;
+  msg+=": ";
+  msg+=strerror(errno);
+  msg+="\n";
+  return msg;
 };
 
-int xorMaskLineLen(const png_data& img)
+//formats a message like printf() with a single string argument
+string formatMessage(const char* format, const char* arg)
 {
-  int pixelsPerByte=(8/img.col_bits);
-  return ((img.width+pixelsPerByte-1)/pixelsPerByte+3)&~3;
+  char buf[1024];
+  snprintf(buf,sizeof(buf),format,arg);
+  return buf;
 };
 
-typedef bool (*checkTransparent_t)(png_bytep, png_data&);
+//Reads the whole file fileName into data. Returns false and sets error on failure.
+bool readFile(const char* fileName, vector<unsigned char>& data, string& error)
+{
+  FILE* f=fopen(fileName,"rb");
+  if (f==NULL) {error=errnoMessage(fileName); return false;};
+  
+  data.clear();
+  unsigned char buf[65536];
+  size_t n;
+  while((n=fread(buf,1,sizeof(buf),f))>0) data.insert(data.end(),buf,buf+n);
+  
+  if (ferror(f)) 
+  {
+    error=errnoMessage(fileName);
+    fclose(f);
+    return false;
+  };
+  fclose(f);
+  return true;
+};
 
-bool checkTransparent1(png_bytep data, png_data&)
+//Writes the size bytes at data to the file fileName. Returns false and sets error
+//on failure.
+bool writeFile(const char* fileName, const unsigned char* data, size_t size, string& error)
 {
-  return (data[3]<transparency_threshold);
+  FILE* f=fopen(fileName,"wb");
+  if (f==NULL) {error=errnoMessage(fileName); return false;};
+  
+  if (fwrite(data,size,1,f)!=1) 
+  {
+    error=errnoMessage(fileName);
+    fclose(f);
+    return false;
+  };
+  if (fclose(f)!=0) {error=errnoMessage(fileName); return false;};
+  return true;
 };
 
-bool checkTransparent3(png_bytep, png_data&)
+//Sets input to the contents of buffer.
+void setInput(input_file& input)
 {
-  return false;
+  input.data=input.buffer.empty() ? (const void*)"" : &input.buffer[0];
+  input.size=input.buffer.size();
 };
 
-//returns true if color reduction resulted in at least one of the image's colors 
-//being mapped to a palette color with a quadratic distance of more than
-//color_reduce_warning_threshold
-bool convertToIndexed(png_data& img, bool hasAlpha)
+//Reads the PNG file fileName into input. Regular files of at least 
+//mmap_read_threshold bytes are mapped into memory, so that libpng2ico decodes them
+//straight from the page cache without copying them first. Smaller files are read
+//with a single read(), which is cheaper than setting up and tearing down a mapping.
+//Returns false and sets error on failure.
+bool readInput(const char* fileName, input_file& input, string& error)
 {
-  int maxColors=img.requested_colors;
+#ifndef _WIN32
+  int fd=open(fileName,O_RDONLY);
+  if (fd<0) {error=errnoMessage(fileName); return false;};
   
-  size_t palSize=sizeof(png_color)*256; //must reserve space for 256 entries here because write loop in main() expects it
-  img.palette=(png_colorp)malloc(palSize);
-  memset(img.palette,0,palSize); //must initialize whole palette because write loop in main() expects it
-  img.num_palette=0;
-  
-  checkTransparent_t checkTrans=checkTransparent1;
-  int bytesPerPixel=4;
-  if (!hasAlpha)
+  struct stat st;
+  if (fstat(fd,&st)!=0) 
   {
-    bytesPerPixel=3;
-    checkTrans=checkTransparent3;  
+    error=errnoMessage(fileName);
+    close(fd);
+    return false;
   };
   
-  //first pass: gather all colors, make sure
-  //alpha channel (if present) contains only 0 and 255
-  //if an alpha channel is present, set all transparent pixels to RGBA (0,0,0,0)
-  //transparent pixels will already be mapped to palette entry 0, non-transparent
-  //pixels will not get a mapping yet (-1)
-  hash_map<unsigned int,signed int> mapQuadToPalEntry;
-  png_bytep* row_pointers=png_get_rows(img.png_ptr, img.info_ptr);
-  
-  for (int y=img.height-1; y>=0; --y)
+  if (S_ISREG(st.st_mode) && (unsigned long long)st.st_size>=mmap_read_threshold && 
+      (unsigned long long)st.st_size<=(size_t)-1)
   {
-    png_bytep pixel=row_pointers[y];
-    for (unsigned i=0; i<img.width; ++i)
+    void* mapping=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (mapping!=MAP_FAILED)
     {
-      unsigned int quad=pixel[0]+(pixel[1]<<8)+(pixel[2]<<16);
-      bool trans=(*checkTrans)(pixel,img);
-     
-      if (hasAlpha) 
-      {
-        if (trans)
-        {
-          pixel[0]=0;
-          pixel[1]=0;
-          pixel[2]=0;
-          pixel[3]=0;
-          quad=0;
-        }
-        else pixel[3]=255;
-        
-        quad+=(pixel[3]<<24);
-      }
-      else if (!trans) quad+=(255<<24);
-      
-      if (trans) 
-        mapQuadToPalEntry[quad]=0;
-      else  
-        mapQuadToPalEntry[quad]=-1;
-    
-      pixel+=bytesPerPixel;
-    };  
-  };
-  
-  //always allocate entry 0 to black and entry 1 to white because
-  //sometimes AND mask is interpreted as color index
-  img.num_palette=2;
-  img.palette[0].red=0;
-  img.palette[0].green=0;
-  img.palette[0].blue=0;
-  img.palette[1].red=255;
-  img.palette[1].green=255;
-  img.palette[1].blue=255;
-  
-  mapQuadToPalEntry[255<<24]=0; //map (non-transparent) black to entry 0
-  mapQuadToPalEntry[255+(255<<8)+(255<<16)+(255<<24)]=1; //map (non-transparent) white to entry 1
-  
-  if (mapQuadToPalEntry.size()*img.requested_colors>slow_reduction_warn_threshold)
-  {
-    fprintf(stdout,"Please be patient. My color reduction algorithm is really slow.\n");
+      close(fd);
+      madvise(mapping,st.st_size,MADV_SEQUENTIAL); //libpng2ico reads the file front to back
+      input.mapping=mapping;
+      input.data=mapping;
+      input.size=st.st_size;
+      return true;
+    };
+    //otherwise fall through and read the file
   };
   
-  //Now fill up the palette with colors from the image by repeatedly picking the
-  //color most different from the previously picked colors and adding this to the
-  //palette. This is done to make sure that in case there are more image colors than
-  //palette entries, palette entries are not wasted on similar colors.
-  while(img.num_palette<maxColors)
+  if (S_ISREG(st.st_mode))
   {
-    unsigned int mostDifferentQuad=0;
-    int mdqMinDist=-1; //smallest distance to an entry in the palette for mostDifferentQuad
-    int mdqDistSum=-1; //sum over all distances to palette entries for mostDifferentQuad
-    hash_map<unsigned int,signed int>::iterator stop=mapQuadToPalEntry.end();
-    hash_map<unsigned int,signed int>::iterator iter=mapQuadToPalEntry.begin();
-    while(iter!=stop)
+    input.buffer.resize(st.st_size);
+    size_t done=0;
+    while (done<input.buffer.size()) 
     {
-      hash_map<unsigned int,signed int>::value_type& mapping=*iter++;
-      if (mapping.second<0)
+      ssize_t n=read(fd,&input.buffer[done],input.buffer.size()-done);
+      if (n<0 && errno==EINTR) continue;
+      if (n<0)
       {
-        unsigned int quad=mapping.first;
-        int red=quad&255;  //must be signed
-        int green=(quad>>8)&255;
-        int blue=(quad>>16)&255;
-        int distSum=0;
-        int minDist=INT_MAX;
-        for (int i=0; i<img.num_palette; ++i)
-        {
-          int dist=(red-img.palette[i].red);
-          dist*=dist;
-          int temp=(green-img.palette[i].green);
-          dist+=temp*temp;
-          temp=(blue-img.palette[i].blue);
-          dist+=temp*temp;
-          if (dist<minDist) minDist=dist;
-          distSum+=dist;
-        };  
-        
-        if (minDist>mdqMinDist || (minDist==mdqMinDist && distSum>mdqDistSum))
-        {
-          mostDifferentQuad=quad;
-          mdqMinDist=minDist;
-          mdqDistSum=distSum;
-        };
+        error=errnoMessage(fileName);
+        close(fd);
+        return false;
       };
+      if (n==0) break; //the file has shrunk
+      done+=n;
     };
-    
-    if (mdqMinDist>0) //if we have found a most different quad, add it to the palette
-    {                  //and map it to the new palette entry
-      int palentry=img.num_palette;
-      img.palette[palentry].red=mostDifferentQuad&255;
-      img.palette[palentry].green=(mostDifferentQuad>>8)&255;
-      img.palette[palentry].blue=(mostDifferentQuad>>16)&255;
-      mapQuadToPalEntry[mostDifferentQuad]=palentry;
-      ++img.num_palette;
+    close(fd);
+    input.buffer.resize(done);
+    setInput(input);
+    return true;
+  };
+  close(fd);
+#endif
+  
+  //pipes, devices and everything on Windows
+  if (!readFile(fileName,input.buffer,error)) return false;
+  setInput(input);
+  return true;
+};
+
+//frees the contents of input
+void releaseInput(input_file& input)
+{
+#ifndef _WIN32
+  if (input.mapping!=NULL) munmap(input.mapping,input.size);
+#endif
+  input.mapping=NULL;
+  vector<unsigned char>().swap(input.buffer);
+  input.data="";
+  input.size=0;
+};
+
+//returns the default number of worker threads, i.e. the number of CPUs
+int defaultNumThreads()
+{
+  int n=thread::hardware_concurrency();
+  if (n<1) n=1;
+  return n;
+};
+
+//returns the peak resident set size of the process in kilobytes (0 if unknown)
+long peakRSS()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF,&usage)!=0) return 0;
+  return usage.ru_maxrss;
+#endif
+};
+
+//returns str as JSON string literal
+string jsonString(const string& str)
+{
+  string json="\"";
+  for (unsigned i=0; i<str.size(); ++i)
+  {
+    unsigned char ch=str[i];
+    if (ch=='"' || ch=='\\') 
+    {
+      json+='\\';
+      json+=ch;
+    }
+    else if (ch<32)
+    {
+      char buf[8];
+      snprintf(buf,sizeof(buf),"\\u%04x",ch);
+      json+=buf;
     }
-    else break; //otherwise (i.e. all quads are mapped) the palette is finished
+    else json+=ch;
   };
+  return json+"\"";
+};
+
+const char* const phaseNames[]={"decode","histogram","palette","mapping","write"};
 
-  //Now map all yet unmapped colors to the most appropriate palette entry
-  hash_map<unsigned int,signed int>::iterator stop=mapQuadToPalEntry.end();
-  hash_map<unsigned int,signed int>::iterator iter=mapQuadToPalEntry.begin();
-  while(iter!=stop)
+//returns the times of the phases of stats in the order of phaseNames
+vector<png2ico_time> phaseTimes(const png2ico_stats& stats)
+{
+  vector<png2ico_time> times;
+  times.push_back(stats.decode);
+  times.push_back(stats.histogram);
+  times.push_back(stats.palette);
+  times.push_back(stats.mapping);
+  times.push_back(stats.write);
+  return times;
+};
+
+//Formats the statistics of icon, which took wall seconds to create (readWall 
+//seconds of them for reading the PNG files), in the given stats_mode.
+string formatStats(const icon_job& icon, int mode, bool ok, double wall, double readWall)
+{
+  char buf[1024];
+  string out;
+  if (mode==STATS_JSON)
   {
-    hash_map<unsigned int,signed int>::value_type& mapping=*iter++;
-    if (mapping.second<0)
+    snprintf(buf,sizeof(buf),",\"ok\":%s,\"wall\":%.6f,\"read_wall\":%.6f,\"peak_rss_kb\":%ld,\"images\":[",
+             ok ? "true" : "false",wall,readWall,peakRSS());
+    out="{\"icon\":"+jsonString(icon.outfileName)+buf;
+    for (unsigned n=0; n<icon.stats.size(); ++n)
     {
-      unsigned int quad=mapping.first;
-      int red=quad&255;  //must be signed
-      int green=(quad>>8)&255;
-      int blue=(quad>>16)&255;
-      int minDist=INT_MAX;
-      int bestIndex=0;
-      for (int i=0; i<img.num_palette; ++i)
+      const png2ico_stats& stats=icon.stats[n];
+      snprintf(buf,sizeof(buf),",\"width\":%d,\"height\":%d,\"format\":\"%s\",\"cached\":%s,\"unique_colors\":%d,"
+               "\"palette_size\":%d,\"max_distance\":%d,\"mean_distance\":%.3f",
+               stats.width,stats.height,formatNames[icon.images[n].format],stats.cached ? "true" : "false",
+               stats.unique_colors,stats.palette_size,stats.max_distance,stats.mean_distance);
+      out+=(n>0 ? ",{\"name\":" : "{\"name\":")+jsonString(icon.imageNames[n])+buf;
+      vector<png2ico_time> times=phaseTimes(stats);
+      for (unsigned p=0; p<times.size(); ++p)
       {
-        int dist=(red-img.palette[i].red);
-        dist*=dist;
-        int temp=(green-img.palette[i].green);
-        dist+=temp*temp;
-        temp=(blue-img.palette[i].blue);
-        dist+=temp*temp;
-        if (dist<minDist) { minDist=dist; bestIndex=i; };
+        snprintf(buf,sizeof(buf),",\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",phaseNames[p],times[p].wall,times[p].cpu);
+        out+=buf;
       };
-      
-      mapping.second=bestIndex; 
+      out+="}";
     };
+    return out+"]}\n";
   };
   
-  //Adjust all palette entries (except for 0 and 1) to be the mean of all
-  //colors mapped to it
-  for (int i=2; i<img.num_palette; ++i)
+  snprintf(buf,sizeof(buf),": %s in %.2f ms (%.2f ms reading), peak RSS %ld KB\n",
+           ok ? "created" : "failed",wall*1000,readWall*1000,peakRSS());
+  out=icon.outfileName+buf;
+  for (unsigned n=0; n<icon.stats.size(); ++n)
   {
-    int red=0;
-    int green=0;
-    int blue=0;
-    int numMappings=0;
-    hash_map<unsigned int,signed int>::iterator stop=mapQuadToPalEntry.end();
-    hash_map<unsigned int,signed int>::iterator iter=mapQuadToPalEntry.begin();
-    while(iter!=stop)
+    const png2ico_stats& stats=icon.stats[n];
+    snprintf(buf,sizeof(buf),": %dx%d %s%s",stats.width,stats.height,formatNames[icon.images[n].format],
+             stats.cached ? " (cached)" : "");
+    out+="  "+icon.imageNames[n]+buf;
+    if (icon.images[n].format==PNG2ICO_PALETTE && !stats.cached)
     {
-      hash_map<unsigned int,signed int>::value_type& mapping=*iter++;
-      if (mapping.second==i)
-      {
-        unsigned int quad=mapping.first;
-        red+=quad&255;
-        green+=(quad>>8)&255;
-        blue+=(quad>>16)&255;
-        ++numMappings;
-      };
+      snprintf(buf,sizeof(buf),", %d colors, %d palette entries, mapping distance max %d mean %.2f",
+               stats.unique_colors,stats.palette_size,stats.max_distance,stats.mean_distance);
+      out+=buf;
     };
-    
-    if (numMappings>0)
+    out+="\n   ";
+    vector<png2ico_time> times=phaseTimes(stats);
+    for (unsigned p=0; p<times.size(); ++p)
     {
-      img.palette[i].red=(red+red+numMappings)/(numMappings+numMappings);
-      img.palette[i].green=(green+green+numMappings)/(numMappings+numMappings);
-      img.palette[i].blue=(blue+blue+numMappings)/(numMappings+numMappings);
+      snprintf(buf,sizeof(buf)," %s %.2f/%.2f",phaseNames[p],times[p].wall*1000,times[p].cpu*1000);
+      out+=buf;
     };
+    out+=" ms (wall/CPU)\n";
   };
+  return out;
+};
 
-  //Now determine if a non-transparent source color got mapped to a target color that 
-  //has a distance that exceeds the threshold
-  bool tooManyColors=false;
-  stop=mapQuadToPalEntry.end();
-  iter=mapQuadToPalEntry.begin();
-  while(iter!=stop)
+//returns the seconds that have passed since start
+double secondsSince(const chrono::steady_clock::time_point& start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+};
+
+//Reads the PNG files of icon, converts them with the given options and writes
+//the icon file. Warnings and errors are appended to messages in the order of the
+//images, the statistics requested with options.stats to stats.
+//Returns false if the icon could not be created.
+bool convertIcon(icon_job& icon, const convert_options& options, string& messages, string& stats)
+{
+  chrono::steady_clock::time_point start=chrono::steady_clock::now();
+  if (options.stats!=STATS_NONE) icon.stats.resize(icon.images.size());
+  icon.contents.resize(icon.fileNames.size());
+  bool ok=true;
+  for (unsigned n=0; ok && n<icon.fileNames.size(); ++n)
   {
-    hash_map<unsigned int,signed int>::value_type& mapping=*iter++;
-    unsigned int quad=mapping.first;
-    if ((quad>>24)!=0) //if color is not transparent
+    icon.images[n].name=icon.imageNames[n].c_str();
+    icon.images[n].cache=options.cache;
+    if (options.stats!=STATS_NONE) icon.images[n].stats=&icon.stats[n];
+    
+    //the sizes of a file are consecutive images. They share its contents, so that
+    //libpng2ico decodes the file only once.
+    if (n>0 && icon.fileIndex[n]==icon.fileIndex[n-1])
     {
-      int red=quad&255;
-      int green=(quad>>8)&255;
-      int blue=(quad>>16)&255;
-      int i=mapping.second;
-      int dist=(red-img.palette[i].red);
-      dist*=dist;
-      int temp=(green-img.palette[i].green);
-      dist+=temp*temp;
-      temp=(blue-img.palette[i].blue);
-      dist+=temp*temp;
-      if (dist>color_reduce_warning_threshold) tooManyColors=true;
+      icon.images[n].png=icon.images[n-1].png;
+      icon.images[n].png_size=icon.images[n-1].png_size;
+      continue;
+    };
+    
+    string error;
+    if (!readInput(icon.fileNames[n].c_str(),icon.contents[n],error))
+    {
+      messages+=error;
+      ok=false;
+      break;
     };
+    icon.images[n].png=icon.contents[n].data;
+    icon.images[n].png_size=icon.contents[n].size;
   };
+  double readWall=secondsSince(start);
   
+  if (ok)
+  {
+    int status;
+    if (icon.update)
+      status=png2ico_update_file(&icon.images[0],icon.images.size(),options.numThreads,
+                                 icon.outfileName.c_str(),&messages);
+    else
+      status=png2ico_convert_to_file(&icon.images[0],icon.images.size(),options.numThreads,
+                                     icon.outfileName.c_str(),&messages);
+    ok=(status==PNG2ICO_OK);
+  };
+  for (unsigned n=0; n<icon.contents.size(); ++n) releaseInput(icon.contents[n]);
+  vector<input_file>().swap(icon.contents);
+  
+  if (options.stats!=STATS_NONE) stats=formatStats(icon,options.stats,ok,secondsSince(start),readWall);
+  return ok;
+};
 
-  int transLineLen=andMaskLineLen(img);
-  int transLinePad=transLineLen - ((img.width+7)/8);
-  img.transMap=(png_bytepp)malloc(img.height*sizeof(png_bytep));
+//parses the number in str. Returns false if str is not a number in [min,max].
+bool parseNumber(const char* str, long min, long max, long& num)
+{
+  char* endptr;
+  num=strtol(str,&endptr,10);
+  return (*str!=0 && *endptr==0 && num>=min && num<=max);
+};
+
+//Parses a comma separated list of sizes in [0,256] into sizes. Returns false if
+//str is not such a list.
+bool parseSizes(const char* str, vector<int>& sizes)
+{
+  sizes.clear();
+  string list=str;
+  size_t start=0;
+  for(;;)
+  {
+    size_t end=list.find(',',start);
+    if (end==string::npos) end=list.size();
+    long num;
+    if (!parseNumber(list.substr(start,end-start).c_str(),0,256,num)) return false;
+    sizes.push_back(num);
+    if (end==list.size()) return true;
+    start=end+1;
+  };
+};
+
+//Parses the arguments of a single icon, i.e. 
+//  icofile|--update icofile [--format <name>] [--sizes <list>] [--shared-palette] [--colors <num>] [--refine <num>] [--quantizer <name>] pngfile1 [pngfile2 ...]
+//and adds the icon file name and its images to icon. With --sizes each PNG file
+//is added once per size. Returns false and sets error
+//if the arguments are invalid.
+bool parseIconArgs(int argc, const char* const* argv, icon_job& icon, string& error)
+{
+  int numColors=256;
+  int numRefine=0;
+  const char* quantizer="farthest";
+  int format=PNG2ICO_PALETTE;
+  vector<int> sizes(1,0);
+  bool sharedPalette=false;
   
-  //second pass: convert RGB to palette entries
-  for (int y=img.height-1; y>=0; --y)
+  for (int i=0; i<argc; ++i)
   {
-    png_bytep row=row_pointers[y];
-    png_bytep pixel=row;
-    int count8=0;
-    int transbyte=0;
-    png_bytep transPtr=img.transMap[y]=(png_bytep)malloc(transLineLen);
+    long num;
+    if (strcmp(argv[i],"--colors")==0)
+    {
+      ++i;
+      if (i>=argc) {error="Number missing after --colors\n"; return false;};
+      if (!parseNumber(argv[i],2,256,num) || (num!=2 && num!=16 && num!=256))
+      {
+        error="Illegal number of colors\n";
+        return false;
+      };
+      numColors=num;
+      continue;
+    };
+    
+    if (strcmp(argv[i],"--shared-palette")==0)
+    {
+      sharedPalette=true;
+      continue;
+    };
+    
+    if (strcmp(argv[i],"--refine")==0)
+    {
+      ++i;
+      if (i>=argc) {error="Number missing after --refine\n"; return false;};
+      if (!parseNumber(argv[i],0,INT_MAX,num))
+      {
+        error="Illegal number of refinement rounds\n";
+        return false;
+      };
+      numRefine=num;
+      continue;
+    };
     
-    for (unsigned i=0; i<img.width; ++i)
+    if (strcmp(argv[i],"--quantizer")==0 || strncmp(argv[i],"--quantizer=",12)==0)
     {
-      bool trans=((*checkTrans)(pixel,img));
-      unsigned int quad=pixel[0]+(pixel[1]<<8)+(pixel[2]<<16);
-      if (!trans) quad+=(255<<24); //NOTE: alpha channel has already been set to 255 for non-transparent pixels, so this is correct even for images with alpha channel
+      const char* name=argv[i]+11;
+      if (*name=='=') 
+        ++name;
+      else
+      {
+        ++i;
+        if (i>=argc) {error="Name missing after --quantizer\n"; return false;};
+        name=argv[i];
+      };
+      quantizer=NULL;
+      for (unsigned q=0; q<sizeof(quantizerNames)/sizeof(quantizerNames[0]); ++q)
+        if (strcmp(name,quantizerNames[q])==0) quantizer=quantizerNames[q];
       
-      if (trans) ++transbyte; 
-      if (++count8==8)
+      if (quantizer==NULL)
+      {
+        error=formatMessage("Unknown quantizer \"%s\"\n",name);
+        return false;
+      };
+      continue;
+    };
+    
+    if (strcmp(argv[i],"--format")==0 || strncmp(argv[i],"--format=",9)==0)
+    {
+      const char* name=argv[i]+8;
+      if (*name=='=') 
+        ++name;
+      else
       {
-        *transPtr++ = transbyte;
-        count8=0;
-        transbyte=0;
+        ++i;
+        if (i>=argc) {error="Name missing after --format\n"; return false;};
+        name=argv[i];
       };
-      transbyte+=transbyte; //shift left 1
+      format=-1;
+      for (unsigned f=0; f<sizeof(formatNames)/sizeof(formatNames[0]); ++f)
+        if (strcmp(name,formatNames[f])==0) format=f;
       
-      int palentry=mapQuadToPalEntry[quad];
-      row[i]=palentry;
-      pixel+=bytesPerPixel;
+      if (format<0)
+      {
+        error=formatMessage("Unknown format \"%s\"\n",name);
+        return false;
+      };
+      continue;
+    };
+    
+    if (strcmp(argv[i],"--sizes")==0 || strncmp(argv[i],"--sizes=",8)==0)
+    {
+      const char* list=argv[i]+7;
+      if (*list=='=') 
+        ++list;
+      else
+      {
+        ++i;
+        if (i>=argc) {error="Sizes missing after --sizes\n"; return false;};
+        list=argv[i];
+      };
+      if (!parseSizes(list,sizes))
+      {
+        error="Illegal list of sizes\n";
+        return false;
+      };
+      continue;
+    };
+    
+    if (strcmp(argv[i],"--update")==0)
+    {
+      ++i;
+      if (i>=argc) {error="File name missing after --update\n"; return false;};
+      if (!icon.outfileName.empty()) {error="--update must precede the PNG files\n"; return false;};
+      icon.outfileName=argv[i];
+      icon.update=true;
+      continue;
+    };
+    
+    if (icon.outfileName.empty()) { icon.outfileName=argv[i]; continue; };
+    
+    if (icon.images.size()+sizes.size()>(unsigned)word_max)
+    {
+      error="Too many PNG files\n";
+      return false;
+    };
+    
+    int file=(icon.fileIndex.empty() ? 0 : icon.fileIndex.back()+1);
+    for (unsigned s=0; s<sizes.size(); ++s)
+    {
+      png2ico_image image;
+      image.format=format;
+      image.size=sizes[s];
+      image.colors=numColors;
+      image.refine=numRefine;
+      image.quantizer=quantizer;
+      image.shared_palette=sharedPalette;
+      icon.images.push_back(image);
+      icon.fileNames.push_back(argv[i]);
+      icon.fileIndex.push_back(file);
+      
+      string name=argv[i];
+      if (sizes[s]>0)
+      {
+        char buf[32];
+        snprintf(buf,sizeof(buf)," (%dx%d)",sizes[s],sizes[s]);
+        name+=buf;
+      };
+      icon.imageNames.push_back(name);
     };
-
-    for(int i=0; i<transLinePad; ++i) *transPtr++ = 0;
   };
   
-  return tooManyColors;
+  return true;
 };
 
-//packs a line of width pixels (1 byte per pixel) in row, with 8/nbits pixels packed
-//into each byte
-//returns the new number of bytes in row
-int pack(png_bytep row,int width,int nbits)
+//A queue of limited capacity for passing jobs from one thread to others. 
+//push() blocks while the queue is full, pop() blocks while it is empty.
+//tryPush() does not block.
+template<class T> class BoundedQueue
 {
-  int pixelsPerByte=8/nbits;
-  if (pixelsPerByte<=1) return width;
-  int ander=(1<<nbits)-1;
-  int outByte=0;
-  int count=0;
-  int outIndex=0;
-  for (int i=0; i<width; ++i)
-  {
-    outByte+=(row[i]&ander);
-    if (++count==pixelsPerByte) 
+  public:
+    BoundedQueue(unsigned cap):capacity(cap),closed(false){};
+    
+    void push(const T& item)
     {
-      row[outIndex]=outByte;
-      count=0;
-      ++outIndex;
-      outByte=0;
+      unique_lock<mutex> lock(mtx);
+      while(items.size()>=capacity) notFull.wait(lock);
+      items.push_back(item);
+      notEmpty.notify_one();
     };
-    outByte<<=nbits;
-  };
+    
+    //adds item unless the queue is full. Returns false if it is.
+    bool tryPush(const T& item)
+    {
+      unique_lock<mutex> lock(mtx);
+      if (items.size()>=capacity) return false;
+      items.push_back(item);
+      notEmpty.notify_one();
+      return true;
+    };
+    
+    //removes the oldest item and stores it in item. Returns false if the queue
+    //is empty and has been closed.
+    bool pop(T& item)
+    {
+      unique_lock<mutex> lock(mtx);
+      while(items.empty() && !closed) notEmpty.wait(lock);
+      if (items.empty()) return false;
+      item=items.front();
+      items.pop_front();
+      notFull.notify_one();
+      return true;
+    };
+    
+    //signals that no more items will be pushed
+    void close()
+    {
+      unique_lock<mutex> lock(mtx);
+      closed=true;
+      notEmpty.notify_all();
+    };
+    
+  private:
+    unsigned capacity;
+    bool closed;
+    deque<T> items;
+    mutex mtx;
+    condition_variable notFull, notEmpty;
+};
 
-  if (count>0) 
-  {
-    outByte<<=nbits*(pixelsPerByte-count);
-    row[outIndex]=outByte;
-    ++outIndex;
-  };  
+//prints stats, which convertIcon() formatted in the given stats_mode
+void printStats(const string& stats, int mode)
+{
+  fputs(stats.c_str(),mode==STATS_JSON ? stdout : stderr);
+  if (mode==STATS_JSON) fflush(stdout);
+};
+
+//shared state of the threads of runBatch()
+struct batch_state
+{
+  const char* manifestName;
+  convert_options options; //the options each icon is converted with
+  BoundedQueue<icon_job> queue;
+  mutex outputMutex;
+  atomic<int> numFailed;
+  batch_state(const char* name, const convert_options& opt, unsigned capacity):manifestName(name),options(opt),queue(capacity),numFailed(0){};
   
-  return outIndex;
+  //prints the messages and statistics for the icon in line
+  void report(int line, const string& messages, const string& stats="")
+  {
+    if (messages.empty() && stats.empty()) return;
+    lock_guard<mutex> lock(outputMutex);
+    if (!messages.empty()) fprintf(stderr,"%s:%d: %s",manifestName,line,messages.c_str());
+    printStats(stats,options.stats);
+  };
 };
 
+void batchWorker(batch_state* state)
+{
+  icon_job icon;
+  while(state->queue.pop(icon))
+  {
+    string messages;
+    string stats;
+    if (!convertIcon(icon,state->options,messages,stats)) ++state->numFailed;
+    state->report(icon.line,messages,stats);
+  };
+};
 
-void usage()
+//Splits a line of a batch manifest into words separated by whitespace. 
+//Double quotes can be used for words that contain whitespace. A # outside
+//of quotes starts a comment that extends to the end of the line.
+vector<string> splitManifestLine(const string& line)
 {
-  fprintf(stderr,version"\n");
-  fprintf(stderr,"USAGE: png2ico icofile [--colors <num>] pngfile1 [pngfile2 ...]\n");
-  exit(1);
+  vector<string> words;
+  unsigned i=0;
+  while(i<line.size())
+  {
+    while(i<line.size() && isspace((unsigned char)line[i])) ++i;
+    if (i>=line.size() || line[i]=='#') break;
+    
+    string word;
+    bool quoted=false;
+    while(i<line.size() && (quoted || !isspace((unsigned char)line[i])))
+    {
+      if (line[i]=='"') 
+        quoted=!quoted;
+      else
+        word+=line[i];
+      ++i;
+    };
+    words.push_back(word);
+  };
+  return words;
 };
 
-int main(int argc, char* argv[])
+//Creates all icons listed in the file manifestName, one per line in the format
+//  icofile|--update icofile [--format <name>] [--sizes <list>] [--shared-palette] [--colors <num>] [--refine <num>] [--quantizer <name>] pngfile1 [pngfile2 ...]
+//with options.numThreads icons being converted in parallel (each by a single
+//thread) and the other options used for all of them. Errors are reported per
+//icon and do not stop the batch. 
+//Returns the exit code for main().
+int runBatch(const char* manifestName, const convert_options& options)
 {
-  if (argc<3) usage();
+  FILE* manifest=fopen(manifestName,"r");
+  if (manifest==NULL) {perror(manifestName); return 1;};
+  
+  int numThreads=options.numThreads;
+  convert_options iconOptions=options;
+  iconOptions.numThreads=1;
+  batch_state state(manifestName,iconOptions,2*numThreads);
+  vector<thread> threads;
+  for (int t=0; t<numThreads; ++t) threads.push_back(thread(batchWorker,&state));
   
-  if (argc-2 > word_max) 
+  int numIcons=0;
+  int lineNo=0;
+  string line;
+  int ch;
+  do
   {
-    fprintf(stderr,"Too many PNG files\n");
-    exit(1);
-  };
+    ch=getc(manifest);
+    if (ch!=EOF && ch!='\n') { line+=(char)ch; continue; };
+    if (ch==EOF && line.empty()) break;
+    
+    ++lineNo;
+    vector<string> words=splitManifestLine(line);
+    line.clear();
+    if (words.empty()) continue;
+    
+    ++numIcons;
+    vector<const char*> args;
+    for (unsigned w=0; w<words.size(); ++w) args.push_back(words[w].c_str());
+    
+    icon_job icon;
+    icon.line=lineNo;
+    string error;
+    if (!parseIconArgs(args.size(),&args[0],icon,error)) 
+    {
+      ++state.numFailed;
+      state.report(lineNo,error);
+    }
+    else if (icon.images.empty())
+    {
+      ++state.numFailed;
+      state.report(lineNo,"icofile or pngfile missing\n");
+    }
+    else state.queue.push(icon);
+  } while(ch!=EOF);
   
-  vector<png_data> pngdata;
+  if (ferror(manifest)) 
+  {
+    perror(manifestName);
+    ++state.numFailed;
+  };
+  fclose(manifest);
   
-  static int numColors=256; //static to get rid of longjmp() clobber warning
-  static const char* outfileName=NULL;
+  state.queue.close();
+  for (int t=0; t<numThreads; ++t) threads[t].join();
   
-  //i is static because used in a setjmp() block
-  for (static int i=1; i<argc; ++i)
+  if (state.numFailed>0)
   {
-    if (strcmp(argv[i],"--colors")==0)
+    fprintf(stderr,"%d of %d icons could not be created\n",(int)state.numFailed,numIcons);
+    return 1;
+  };
+  return 0;
+};
+
+#ifndef _WIN32
+//Waits until fd is ready for events. Returns false if deadline passes or stopFd
+//becomes readable first.
+bool waitReady(int fd, short events, const chrono::steady_clock::time_point& deadline, int stopFd)
+{
+  for(;;)
+  {
+    long long ms=chrono::duration_cast<chrono::milliseconds>(deadline-chrono::steady_clock::now()).count();
+    if (ms<0) return false;
+    pollfd p[2];
+    p[0].fd=fd;
+    p[0].events=events;
+    p[0].revents=0;
+    p[1].fd=stopFd;
+    p[1].events=POLLIN;
+    p[1].revents=0;
+    int n=poll(p,2,(int)ms);
+    if (n<0 && errno==EINTR) continue;
+    return n>0 && p[0].revents!=0;
+  };
+};
+
+//A connection to a --serve client with buffered reading. Reading and sending 
+//return false if the client closed the connection, sent too much, did not 
+//finish within serve_timeout seconds after startRequest() or the server is 
+//stopping. The connection is closed when the object is deleted.
+class ClientConnection
+{
+  public:
+    chrono::steady_clock::time_point idleSince; //when the last request was answered
+    
+    ClientConnection(int f, int stop):idleSince(chrono::steady_clock::now()),fd(f),stopFd(stop),pos(0),len(0){};
+    ~ClientConnection(){close(fd);};
+    
+    int socket() const {return fd;};
+    
+    //starts the time limit for reading a request and sending its response
+    void startRequest() {deadline=chrono::steady_clock::now()+chrono::seconds(serve_timeout);};
+    
+    //returns true if data that has not been read yet is buffered
+    bool buffered() const {return pos<len;};
+    
+    //frees the buffer while the connection is idle
+    void releaseBuffer() {if (!buffered()) vector<char>().swap(buf);};
+    
+    //reads a line without its terminating newline. Returns false if it is longer than maxLength.
+    bool readLine(string& line, size_t maxLength)
     {
-      ++i;
-      if (i>=argc)
+      line.clear();
+      for(;;)
       {
-        fprintf(stderr,"Number missing after --colors\n");
-        exit(1);
+        if (pos==len && !fill()) return false;
+        char* end=(char*)memchr(&buf[pos],'\n',len-pos);
+        size_t n=(end==NULL ? len-pos : end-&buf[pos]);
+        if (line.size()+n>maxLength) return false;
+        line.append(&buf[pos],n);
+        pos+=n;
+        if (end!=NULL) { ++pos; return true; };
       };
-      char* endptr;
-      long num=strtol(argv[i],&endptr,10);
-      if (*(argv[i])==0 || *endptr!=0 || (num!=2 && num!=16 && num!=256))
+    };
+    
+    //Appends the next size bytes to data. data grows as the bytes arrive, so that
+    //a client cannot make the server allocate memory by merely announcing a size.
+    bool read(vector<unsigned char>& data, size_t size)
+    {
+      while(size>0)
       {
-        fprintf(stderr,"Illegal number of colors\n");
-        exit(1);
+        if (pos==len && !fill()) return false;
+        size_t n=min(size,len-pos);
+        data.insert(data.end(),(unsigned char*)&buf[pos],(unsigned char*)&buf[pos]+n);
+        pos+=n;
+        size-=n;
       };
-      numColors=num;
-      continue;
+      return true;
     };
     
-    if (outfileName==NULL) { outfileName=argv[i]; continue; };
+    //sends the size bytes at data
+    bool send(const void* data, size_t size)
+    {
+      const char* p=(const char*)data;
+      while(size>0)
+      {
+        ssize_t n=::send(fd,p,size,MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (n<0 && errno==EINTR) continue;
+        if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+        {
+          if (!waitReady(fd,POLLOUT,deadline,stopFd)) return false;
+          continue;
+        };
+        if (n<=0) return false;
+        p+=n;
+        size-=n;
+      };
+      return true;
+    };
     
-    FILE* pngfile=fopen(argv[i],"rb");
-    if (pngfile==NULL)  {perror(argv[i]); exit(1);};
-    png_byte header[8];
-    if (fread(header,8,1,pngfile)!=1) {perror(argv[i]); exit(1);};
-    if (png_sig_cmp(header,0,8))
+    //Returns true if the client has closed the connection. A client that only
+    //shut down its sending side is still waiting for the response.
+    bool gone() const
     {
-      fprintf(stderr,"%s: Not a PNG file\n",argv[i]);
-      exit(1);
+      pollfd p;
+      p.fd=fd;
+      p.events=0;
+      p.revents=0;
+      return poll(&p,1,0)>0 && (p.revents & (POLLHUP|POLLERR))!=0;
     };
     
-    png_data data;
-    data.requested_colors=numColors;
-    for (data.col_bits=1; (1<<data.col_bits)<numColors; ++data.col_bits);
+  private:
+    ClientConnection(const ClientConnection&);
+    ClientConnection& operator=(const ClientConnection&);
     
-    data.png_ptr=png_create_read_struct
-                   (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!data.png_ptr)
+    bool fill()
     {
-      fprintf(stderr,"png_create_read_struct error\n");
-      exit(1);
-    };  
+      if (buf.empty()) buf.resize(65536);
+      for(;;)
+      {
+        ssize_t n=recv(fd,&buf[0],buf.size(),MSG_DONTWAIT);
+        if (n<0 && errno==EINTR) continue;
+        if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+        {
+          if (!waitReady(fd,POLLIN,deadline,stopFd)) return false;
+          continue;
+        };
+        if (n<=0) return false;
+        pos=0;
+        len=n;
+        return true;
+      };
+    };
+    
+    int fd;
+    int stopFd; //becomes readable when the server is stopping
+    chrono::steady_clock::time_point deadline;
+    vector<char> buf;
+    size_t pos, len;
+};
+
+//Sends the response to a request: a line with the png2ico_status, the size of the
+//icon and the size of the messages, followed by the icon and the messages.
+bool sendResponse(ClientConnection& client, int status, const vector<unsigned char>& ico, const string& messages)
+{
+  char header[64];
+  snprintf(header,sizeof(header),"%d %lu %lu\n",status,(unsigned long)ico.size(),(unsigned long)messages.size());
+  return client.send(header,strlen(header)) && (ico.empty() || client.send(&ico[0],ico.size())) &&
+         client.send(messages.data(),messages.size());
+};
+
+//Reads a request from client, i.e. a line with the arguments of an icon as in a
+//batch manifest, but without the icon file name and with --update not allowed,
+//and then for each PNG file in the arguments a line with its size in bytes,
+//followed by its contents. Returns false if the connection has to be closed. 
+//Otherwise sets status to PNG2ICO_OK and fills in icon, or sets status and 
+//messages if the arguments are invalid. The PNG files are not read then, because
+//it is not known how many follow.
+bool readRequest(ClientConnection& client, icon_job& icon, int& status, string& messages)
+{
+  string line;
+  if (!client.readLine(line,max_request_line)) return false;
+  
+  vector<string> words=splitManifestLine(line);
+  words.insert(words.begin(),"(socket)"); //in place of the icon file name
+  vector<const char*> args;
+  for (unsigned w=0; w<words.size(); ++w) args.push_back(words[w].c_str());
+  
+  status=PNG2ICO_INVALID_ARGUMENT;
+  if (find(words.begin(),words.end(),"--update")!=words.end())
+  {
+    messages="--update is not possible with --serve\n";
+    return true;
+  };
+  if (!parseIconArgs(args.size(),&args[0],icon,messages)) return true;
+  
+  int numFiles=(icon.fileIndex.empty() ? 0 : icon.fileIndex.back()+1);
+  icon.contents.resize(numFiles);
+  size_t total=0;
+  for (int f=0; f<numFiles; ++f)
+  {
+    long size;
+    if (!client.readLine(line,max_request_line) || !parseNumber(line.c_str(),0,LONG_MAX,size) ||
+        (size_t)size>max_request_size-total) return false;
+    total+=size;
+    if (!client.read(icon.contents[f].buffer,size)) return false;
+    setInput(icon.contents[f]);
+  };
+  
+  if (icon.images.empty())
+  {
+    messages="pngfile missing\n";
+    return true;
+  };
+  status=PNG2ICO_OK;
+  return true;
+};
 
-    data.info_ptr=png_create_info_struct(data.png_ptr);
-    if (!data.info_ptr)
+//Answers the next request of client. Returns false if the connection has to be
+//closed, i.e. if the client has disconnected or sent a request with invalid
+//arguments. Requests are not converted if the client has disconnected in the
+//meantime.
+bool serveRequest(ClientConnection& client, const convert_options& options)
+{
+  client.startRequest();
+  icon_job icon;
+  int status;
+  string messages;
+  if (!readRequest(client,icon,status,messages)) return false;
+  
+  vector<unsigned char> ico;
+  if (status!=PNG2ICO_OK)
+  {
+    sendResponse(client,status,ico,messages);
+    return false;
+  };
+  
+  //the client has given up while its request was being received
+  if (client.gone()) return false;
+  
+  for (unsigned n=0; n<icon.images.size(); ++n)
+  {
+    const input_file& png=icon.contents[icon.fileIndex[n]];
+    icon.images[n].name=icon.imageNames[n].c_str();
+    icon.images[n].png=png.data;
+    icon.images[n].png_size=png.size;
+    icon.images[n].cache=options.cache;
+  };
+  status=png2ico_convert(&icon.images[0],icon.images.size(),options.numThreads,ico,&messages);
+  
+  return sendResponse(client,status,ico,messages);
+};
+
+//shared state of the threads of runServer()
+struct server_state
+{
+  convert_options options;
+  BoundedQueue<ClientConnection*> queue; //connections with a request to be answered
+  mutex mtx;
+  vector<ClientConnection*> answered; //connections handed back to the main thread, protected by mtx
+  int wakeFd; //written to when a worker has answered a request
+  atomic<int> numClients; //open connections
+  server_state(const convert_options& opt, unsigned capacity, int wake):options(opt),queue(capacity),wakeFd(wake),numClients(0){};
+};
+
+//Answers the requests of the connections in state->queue. A connection is handed
+//back to the main thread after each request, so that clients which keep their
+//connection open between requests do not occupy a thread.
+void serverWorker(server_state* state)
+{
+  ClientConnection* client;
+  while(state->queue.pop(client)) 
+  {
+    //requests the client has already sent (partly) are answered right away
+    bool open=!client->gone();
+    do open=open && serveRequest(*client,state->options); while(open && client->buffered());
+    if (open)
+    {
+      client->releaseBuffer();
+      client->idleSince=chrono::steady_clock::now();
+      lock_guard<mutex> lock(state->mtx);
+      state->answered.push_back(client);
+    }
+    else
     {
-      png_destroy_read_struct(&data.png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-      fprintf(stderr,"png_create_info_struct error\n");
-      exit(1);
+      delete client;
+      --state->numClients;
     };
+    
+    //the main thread can now pass on another connection; if the pipe is full it is awake anyway
+    ssize_t ignored=write(state->wakeFd,"c",1);
+    (void)ignored;
+  };
+};
+
+volatile sig_atomic_t stopServer=0;
+int stopWakeFd=-1; //written to by handleStopSignal() to wake the main thread
+
+void handleStopSignal(int)
+{
+  stopServer=1;
+  int saved=errno;
+  ssize_t ignored=write(stopWakeFd,"s",1);
+  (void)ignored;
+  errno=saved;
+};
+
+//creates a pipe whose ends do not block. Returns false on failure.
+bool makePipe(int fds[2])
+{
+  if (pipe(fds)!=0) return false;
+  fcntl(fds[0],F_SETFL,O_NONBLOCK);
+  fcntl(fds[1],F_SETFL,O_NONBLOCK);
+  return true;
+};
 
-    data.end_info=png_create_info_struct(data.png_ptr);
-    if (!data.end_info)
+//Accepts connections on the Unix domain socket socketName and answers the
+//requests sent over them (see readRequest()) with options.numThreads threads,
+//which are started in advance. Each thread answers one request at a time with a
+//single conversion thread. The main thread waits for requests on the idle 
+//connections and passes the connections that have one to the threads; these
+//wait in a queue while all threads are busy. Idle connections are closed after
+//serve_timeout seconds. Runs until SIGINT or SIGTERM. Returns the exit code for main().
+int runServer(const char* socketName, const convert_options& options)
+{
+  sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  if (strlen(socketName)>=sizeof(addr.sun_path))
+  {
+    fprintf(stderr,"%s: Socket name too long\n",socketName);
+    return 1;
+  };
+  strcpy(addr.sun_path,socketName);
+  
+  int sock=socket(AF_UNIX,SOCK_STREAM,0);
+  if (sock<0) {perror("socket"); return 1;};
+  
+  //a socket left behind by a server that has died is removed, a running server is not disturbed
+  struct stat st;
+  if (lstat(socketName,&st)==0 && S_ISSOCK(st.st_mode))
+  {
+    if (connect(sock,(sockaddr*)&addr,sizeof(addr))==0)
     {
-      png_destroy_read_struct(&data.png_ptr, &data.info_ptr, (png_infopp)NULL);
-      fprintf(stderr,"png_create_info_struct error\n");
-      exit(1);
+      fprintf(stderr,"%s: Another server is running\n",socketName);
+      close(sock);
+      return 1;
     };
+    unlink(socketName);
+  };
+  
+  if (bind(sock,(sockaddr*)&addr,sizeof(addr))!=0 || listen(sock,SOMAXCONN)!=0)
+  {
+    perror(socketName);
+    close(sock);
+    return 1;
+  };
+  fcntl(sock,F_SETFL,O_NONBLOCK); //a client may disconnect between poll() and accept()
+  
+  //wakePipe wakes the main thread, stopPipe makes the workers give up on their clients
+  int wakePipe[2], stopPipe[2];
+  if (!makePipe(wakePipe) || !makePipe(stopPipe))
+  {
+    perror("pipe");
+    close(sock);
+    unlink(socketName);
+    return 1;
+  };
+  stopWakeFd=wakePipe[1];
+  
+  //SIGINT and SIGTERM wake the main thread; the workers do not get them
+  struct sigaction action;
+  memset(&action,0,sizeof(action));
+  action.sa_handler=handleStopSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT,&action,NULL);
+  sigaction(SIGTERM,&action,NULL);
+  signal(SIGPIPE,SIG_IGN);
+  sigset_t stopSignals, oldMask;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals,SIGINT);
+  sigaddset(&stopSignals,SIGTERM);
+  pthread_sigmask(SIG_BLOCK,&stopSignals,&oldMask);
+  
+  int numThreads=options.numThreads;
+  convert_options clientOptions=options;
+  clientOptions.numThreads=1;
+  server_state state(clientOptions,numThreads,wakePipe[1]);
+  vector<thread> threads;
+  for (int t=0; t<numThreads; ++t) threads.push_back(thread(serverWorker,&state));
+  pthread_sigmask(SIG_SETMASK,&oldMask,NULL);
+  
+  vector<ClientConnection*> idle;    //connections waiting for the next request
+  deque<ClientConnection*> pending;  //connections with a request that did not fit into state.queue
+  int exitCode=0;
+  while(!stopServer)
+  {
+    while(!pending.empty() && state.queue.tryPush(pending.front())) pending.pop_front();
     
-    if (setjmp(png_jmpbuf(data.png_ptr)))
+    //new connections wait in the listen queue while there are max_clients
+    vector<pollfd> fds(2+idle.size());
+    fds[0].fd=wakePipe[0];
+    fds[1].fd=(state.numClients<max_clients ? sock : -1);
+    for (unsigned c=0; c<idle.size(); ++c) fds[2+c].fd=idle[c]->socket();
+    for (unsigned f=0; f<fds.size(); ++f) 
     {
-      png_destroy_read_struct(&data.png_ptr, &data.info_ptr, &data.end_info);
-      fprintf(stderr,"%s: PNG error\n",argv[i]);
-      exit(1);
+      fds[f].events=POLLIN;
+      fds[f].revents=0;
     };
     
-    png_init_io(data.png_ptr, pngfile);
-    png_set_sig_bytes(data.png_ptr,8);
-    int trafo=PNG_TRANSFORM_PACKING|PNG_TRANSFORM_STRIP_16|PNG_TRANSFORM_EXPAND;
-    png_read_png(data.png_ptr, data.info_ptr, trafo , NULL);
-
-    int bit_depth, color_type, interlace_type, compression_type, filter_method;
-    png_get_IHDR(data.png_ptr, data.info_ptr, &data.width, &data.height, &bit_depth, &color_type, 
-                 &interlace_type, &compression_type, &filter_method);
-                 
-    
+    chrono::steady_clock::time_point now=chrono::steady_clock::now();
+    long long timeout=-1;
+    for (unsigned c=0; c<idle.size(); ++c)
+    {
+      long long left=chrono::duration_cast<chrono::milliseconds>(
+                       idle[c]->idleSince+chrono::seconds(serve_timeout)-now).count()+1;
+      if (timeout<0 || left<timeout) timeout=max(left,0LL);
+    };
     
-    if ( (data.width&7)!=0 || data.width>=256 || data.height>=256)
+    if (poll(&fds[0],fds.size(),(int)timeout)<0)
     {
-      //I don't know if the following is really a requirement (bmp.txt says that
-      //only 16x16, 32x32 and 64x64 are allowed but that doesn't seem right) but
-      //if the width is not a multiple of 8, then the loop creating the and mask later
-      //doesn't work properly because it doesn't shift in padding bits
-      fprintf(stderr,"%s: Width must be multiple of 8 and <256. Height must be <256.\n",argv[i]);
-      exit(1);
+      if (errno==EINTR) continue;
+      perror("poll");
+      exitCode=1;
+      break;
     };
     
-    if ((color_type & PNG_COLOR_MASK_COLOR)==0)
+    //idle connections with a request (or a closed connection) go to the workers
+    now=chrono::steady_clock::now();
+    vector<ClientConnection*> stillIdle;
+    for (unsigned c=0; c<idle.size(); ++c)
     {
-      fprintf(stderr,"%s: Grayscale image not supported\n",argv[i]);
-      exit(1);
+      if (fds[2+c].revents!=0)
+        pending.push_back(idle[c]);
+      else if (now-idle[c]->idleSince>=chrono::seconds(serve_timeout))
+      {
+        delete idle[c];
+        --state.numClients;
+      }
+      else
+        stillIdle.push_back(idle[c]);
     };
+    idle.swap(stillIdle);
     
-    if (color_type==PNG_COLOR_TYPE_PALETTE)
+    if (fds[0].revents!=0)
     {
-      fprintf(stderr,"This can't happen. PNG_TRANSFORM_EXPAND transforms image to RGB.\n");
-      exit(1);
-    }
-    else
+      char drain[256];
+      while(read(wakePipe[0],drain,sizeof(drain))>0) {};
+    };
+    {
+      lock_guard<mutex> lock(state.mtx);
+      idle.insert(idle.end(),state.answered.begin(),state.answered.end());
+      state.answered.clear();
+    };
+    
+    if (fds[1].revents!=0)
     {
-      if (convertToIndexed(data, ((color_type & PNG_COLOR_MASK_ALPHA)!=0)))
+      int fd=accept(sock,NULL,NULL);
+      if (fd>=0) 
+      {
+        idle.push_back(new ClientConnection(fd,stopPipe[0]));
+        ++state.numClients;
+      }
+      else if (errno!=EINTR && errno!=ECONNABORTED && errno!=EAGAIN && errno!=EWOULDBLOCK &&
+               errno!=EMFILE && errno!=ENFILE)
       {
-        fprintf(stderr,"%s: Warning! Color reduction may not be optimal!\nIf the result is not satisfactory, reduce the number of colors\nbefore using png2ico.\n",argv[i]);
+        perror("accept");
+        exitCode=1;
+        break;
       };
-    };  
-    
-    pngdata.push_back(data);
-    
-    fclose(pngfile);
+    };
   };
   
+  close(sock);
+  unlink(socketName);
+  
+  ssize_t ignored=write(stopPipe[1],"s",1);
+  (void)ignored;
+  state.queue.close();
+  for (int t=0; t<numThreads; ++t) threads[t].join();
+  
+  for (unsigned c=0; c<idle.size(); ++c) delete idle[c];
+  for (unsigned c=0; c<pending.size(); ++c) delete pending[c];
+  for (unsigned c=0; c<state.answered.size(); ++c) delete state.answered[c];
+  close(wakePipe[0]);
+  close(wakePipe[1]);
+  close(stopPipe[0]);
+  close(stopPipe[1]);
+  return exitCode;
+};
+#endif
 
-  if (outfileName==NULL || pngdata.size()<1) usage();
+//Prints the images of the icon file icoName. Returns the exit code for main().
+int listImages(const char* icoName)
+{
+  string messages;
+  png2ico_icon* icon;
+  if (png2ico_open(icoName,&icon,&messages)!=PNG2ICO_OK)
+  {
+    fputs(messages.c_str(),stderr);
+    return 1;
+  };
   
-  FILE* outfile=fopen(outfileName,"wb");
-  if (outfile==NULL) {perror(argv[1]); exit(1);};
+  for (int n=0; n<png2ico_num_entries(icon); ++n)
+  {
+    const png2ico_entry* entry=png2ico_get_entry(icon,n);
+    printf("%d: %dx%d, %d bits, %s, %lu bytes\n",n,entry->width,entry->height,entry->bits,
+           entry->png ? "PNG" : "bitmap",(unsigned long)entry->size);
+  };
+  png2ico_close(icon);
+  return 0;
+};
+
+//Stores the image of the icon file icoName that is best suited for size x size
+//pixels as PNG file pngName. Returns the exit code for main().
+int extractImage(const char* icoName, const char* sizeArg, const char* pngName)
+{
+  long size;
+  if (!parseNumber(sizeArg,1,INT_MAX,size))
+  {
+    fprintf(stderr,"Illegal size\n");
+    return 1;
+  };
   
-  writeWord(outfile,0); //idReserved
-  writeWord(outfile,1); //idType
-  writeWord(outfile,pngdata.size()); //idCount
+  string messages;
+  png2ico_icon* icon;
+  if (png2ico_open(icoName,&icon,&messages)!=PNG2ICO_OK)
+  {
+    fputs(messages.c_str(),stderr);
+    return 1;
+  };
   
-  int offset=6+pngdata.size()*16;
+  int n=png2ico_best_entry(icon,size);
+  vector<unsigned char> png;
+  bool ok=(n>=0 && png2ico_entry_to_png(icon,n,png,&messages)==PNG2ICO_OK);
+  if (n<0) messages+=formatMessage("%s: No images\n",icoName);
+  png2ico_close(icon);
   
-  vector<png_data>::const_iterator img;
-  for(img=pngdata.begin(); img!=pngdata.end(); ++img)
+  string error;
+  if (ok && !writeFile(pngName,&png[0],png.size(),error)) 
   {
-    writeByte(outfile,img->width); //bWidth
-    writeByte(outfile,img->height); //bHeight
-    writeByte(outfile,img->requested_colors&255); //bColorCount
-    writeByte(outfile,0); //bReserved
-    writeWord(outfile,0); //wPlanes
-    writeWord(outfile,0); //wBitCount
-    int resSize=40+img->requested_colors*4+(andMaskLineLen(*img)+xorMaskLineLen(*img))*img->height;
-    writeDWord(outfile,resSize); //dwBytesInRes
-    writeDWord(outfile,offset); //dwImageOffset
-    offset+=resSize;
+    messages+=error;
+    ok=false;
+  };
+  fputs(messages.c_str(),stderr);
+  return ok ? 0 : 1;
+};
+
+void usage()
+{
+  fprintf(stderr,version"\n");
+  fprintf(stderr,"USAGE: png2ico icofile [-j <num>] [--stats[=json]] [--cache-dir <dir> [--cache-size <MB>]] [--format palette|bgra|png] [--sizes <num>,<num>,...] [--shared-palette] [--colors <num>] [--refine <num>] [--quantizer farthest|mediancut|wu] pngfile1 [pngfile2 ...]\n");
+  fprintf(stderr,"       png2ico --update icofile [options] pngfile1 [pngfile2 ...]\n");
+  fprintf(stderr,"       png2ico [-j <num>] [--stats[=json]] [--cache-dir <dir> [--cache-size <MB>]] --batch manifest\n");
+  fprintf(stderr,"       png2ico [-j <num>] [--cache-dir <dir> [--cache-size <MB>]] --serve socket\n");
+  fprintf(stderr,"       png2ico --list icofile\n");
+  fprintf(stderr,"       png2ico --extract icofile <size> pngfile\n");
+  exit(1);
+};
+
+int main(int argc, char* argv[])
+{
+  if (argc<3) usage();
+  if (strcmp(argv[1],"--list")==0) 
+  {
+    if (argc!=3) usage();
+    return listImages(argv[2]);
+  };
+  if (strcmp(argv[1],"--extract")==0) 
+  {
+    if (argc!=5) usage();
+    return extractImage(argv[2],argv[3],argv[4]);
   };
   
+  convert_options options;
+  options.numThreads=defaultNumThreads();
+  const char* batchName=NULL;
+  const char* socketName=NULL;
+  png2ico_cache cache;
+  cache.max_size=default_cache_size;
+  vector<const char*> args; //all arguments except for the global options
   
-  for(img=pngdata.begin(); img!=pngdata.end(); ++img)
+  for (int i=1; i<argc; ++i)
   {
-    writeDWord(outfile,40); //biSize
-    writeDWord(outfile,img->width); //biWidth
-    writeDWord(outfile,2*img->height); //biHeight (2 times because the 2 masks are counted)
-    writeWord(outfile,1);   //biPlanes
-    writeWord(outfile,img->col_bits);   //biBitCount
-    writeDWord(outfile,0);  //biCompression
-    writeDWord(outfile,(andMaskLineLen(*img)+xorMaskLineLen(*img))*img->height);  //biSizeImage
-    writeDWord(outfile,0);  //biXPelsPerMeter
-    writeDWord(outfile,0);  //biYPelsPerMeter
-    writeDWord(outfile,0); //biClrUsed (MUST BE 0 ACCORDING TO bmp.txt!!! I tried putting the real number here, but this breaks icons in some places)
-    writeDWord(outfile,0);   //biClrImportant
-    for (int i=0; i<img->requested_colors; ++i)
+    if (strcmp(argv[i],"-j")==0)
+    {
+      ++i;
+      if (i>=argc)
+      {
+        fprintf(stderr,"Number missing after -j\n");
+        exit(1);
+      };
+      long num;
+      if (!parseNumber(argv[i],1,INT_MAX,num))
+      {
+        fprintf(stderr,"Illegal number of threads\n");
+        exit(1);
+      };
+      options.numThreads=num;
+      continue;
+    };
+    
+    if (strcmp(argv[i],"--stats")==0 || strcmp(argv[i],"--stats=text")==0)
+    {
+      options.stats=STATS_TEXT;
+      continue;
+    };
+    
+    if (strncmp(argv[i],"--stats=",8)==0)
+    {
+      if (strcmp(argv[i]+8,"json")!=0)
+      {
+        fprintf(stderr,"Unknown statistics format \"%s\"\n",argv[i]+8);
+        exit(1);
+      };
+      options.stats=STATS_JSON;
+      continue;
+    };
+    
+    if (strcmp(argv[i],"--cache-dir")==0)
     {
-      char col[4];
-      col[0]=img->palette[i].blue;
-      col[1]=img->palette[i].green;
-      col[2]=img->palette[i].red;
-      col[3]=0;
-      if (fwrite(col,4,1,outfile)!=1) {perror("Write error"); exit(1);};
+      ++i;
+      if (i>=argc)
+      {
+        fprintf(stderr,"Directory missing after --cache-dir\n");
+        exit(1);
+      };
+      cache.dir=argv[i];
+      continue;
     };
     
-    png_bytep* row_pointers=png_get_rows(img->png_ptr, img->info_ptr);
-    for (int y=img->height-1; y>=0; --y)
+    if (strcmp(argv[i],"--cache-size")==0)
     {
-      png_bytep row=row_pointers[y];
-      int newLength=pack(row,img->width,img->col_bits);
-      if (fwrite(row,newLength,1,outfile)!=1) {perror("Write error"); exit(1);};
-      for(int i=0; i<xorMaskLineLen(*img)-newLength; ++i) writeByte(outfile,0);
+      ++i;
+      if (i>=argc)
+      {
+        fprintf(stderr,"Number missing after --cache-size\n");
+        exit(1);
+      };
+      long num;
+      if (!parseNumber(argv[i],1,INT_MAX,num))
+      {
+        fprintf(stderr,"Illegal cache size\n");
+        exit(1);
+      };
+      cache.max_size=num*1048576LL;
+      continue;
     };
     
-    for (int y=img->height-1; y>=0; --y)
+    if (strcmp(argv[i],"--batch")==0)
     {
-      png_bytep transPtr=img->transMap[y];
-      if (fwrite(transPtr,andMaskLineLen(*img),1,outfile)!=1) {perror("Write error"); exit(1);};
+      ++i;
+      if (i>=argc)
+      {
+        fprintf(stderr,"File name missing after --batch\n");
+        exit(1);
+      };
+      batchName=argv[i];
+      continue;
     };
+    
+    if (strcmp(argv[i],"--serve")==0)
+    {
+      ++i;
+      if (i>=argc)
+      {
+        fprintf(stderr,"Socket name missing after --serve\n");
+        exit(1);
+      };
+      socketName=argv[i];
+      continue;
+    };
+    
+    args.push_back(argv[i]);
   };
   
-  fclose(outfile);
+  if (cache.dir!=NULL) options.cache=&cache;
+  if (socketName!=NULL)
+  {
+    if (!args.empty() || batchName!=NULL) usage();
+    if (options.stats!=STATS_NONE)
+    {
+      fprintf(stderr,"--stats is not possible with --serve\n");
+      return 1;
+    };
+#ifdef _WIN32
+    fprintf(stderr,"--serve is not available on Windows\n");
+    return 1;
+#else
+    return runServer(socketName,options);
+#endif
+  };
+  
+  if (batchName!=NULL)
+  {
+    if (!args.empty()) usage();
+    return runBatch(batchName,options);
+  };
+  
+  icon_job icon;
+  string error;
+  if (!parseIconArgs(args.size(),&args[0],icon,error))
+  {
+    fputs(error.c_str(),stderr);
+    exit(1);
+  };
+  
+  if (icon.images.empty()) usage();
+  
+  string messages;
+  string stats;
+  bool ok=convertIcon(icon,options,messages,stats);
+  fputs(messages.c_str(),stderr);
+  printStats(stats,options.stats);
+  return ok ? 0 : 1;
 };
-
-